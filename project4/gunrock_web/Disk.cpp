@@ -8,16 +8,29 @@
 #include <sys/uio.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <dirent.h>
+#include <string.h>
 
 #include "Disk.h"
 #include "dthread.h"
 
 using namespace std;
 
+// snapshots of an image are kept in <image>.snapshot.<name>
+static const string SNAPSHOT_SUFFIX = ".snapshot.";
+
+DiskSnapshot::~DiskSnapshot() {
+  close(fd);
+}
+
 Disk::Disk(string imageFile, int blockSize) {
   this->imageFile = imageFile;
   this->blockSize = blockSize;
   this->isInTransaction = false;
+  this->needsSync = false;
+  this->origin = NULL;
+  this->writes.store(0);
+  pthread_mutex_init(&snapshotLock, NULL);
   
   struct stat stat;
   int imageFileDescriptor = open(imageFile.c_str(), O_RDONLY);
@@ -41,7 +54,20 @@ Disk::Disk(string imageFile, int blockSize) {
     cerr << "  imageSize % blockSize: " << this->imageFileSize % this->blockSize << endl;
     exit(1);
   }
-  
+
+  loadSnapshots();
+}
+
+Disk::Disk(Disk *origin, shared_ptr<DiskSnapshot> snapshot) {
+  this->imageFile = origin->imageFile;
+  this->blockSize = origin->blockSize;
+  this->imageFileSize = origin->imageFileSize;
+  this->isInTransaction = false;
+  this->needsSync = false;
+  this->origin = origin;
+  this->snapshot = snapshot;
+  this->writes.store(0);
+  pthread_mutex_init(&snapshotLock, NULL);
 }
 
 int Disk::numberOfBlocks() {
@@ -49,10 +75,15 @@ int Disk::numberOfBlocks() {
 }
 
 void Disk::readBlock(int blockNumber, void *buffer) {
+  diskStats.add(DISK_BLOCK_READS);
   if (blockNumber < 0 || blockNumber >= this->numberOfBlocks()) {
     cerr << "Invalid block number " << blockNumber << endl;
     exit(1);
   }
+  if (origin != NULL) {
+    origin->readSnapshotBlock(snapshot.get(), blockNumber, buffer);
+    return;
+  }
 
   int fd = open(this->imageFile.c_str(), O_RDONLY);
   if (fd < 0) {
@@ -78,12 +109,19 @@ void Disk::readBlock(int blockNumber, void *buffer) {
 }
 
 void Disk::writeBlock(int blockNumber, void *buffer) {  
+  diskStats.add(DISK_BLOCK_WRITES);
   if (blockNumber < 0 || blockNumber >= this->numberOfBlocks()) {
     cerr << "Invalid block number " << blockNumber << endl;
     exit(1);
   }
+  if (origin != NULL) {
+    cerr << "Snapshots are read-only" << endl;
+    exit(1);
+  }
 
-  if (isInTransaction) {
+  // the first write to a block in a transaction saves what it held before
+  // the transaction, later writes to it have nothing to add
+  if (isInTransaction && undoneBlocks.insert(blockNumber).second) {
     struct UndoRecord undoRecord;
     undoRecord.blockNumber = blockNumber;
     undoRecord.blockData = new unsigned char[blockSize];
@@ -91,6 +129,9 @@ void Disk::writeBlock(int blockNumber, void *buffer) {
     undoLog.push_front(undoRecord);
   }
   
+  dthread_mutex_lock(&snapshotLock);
+  preserveBlock(blockNumber);
+
   int fd = open(this->imageFile.c_str(), O_RDWR);
   if (fd < 0) {
     cerr << "Could not open image file " << this->imageFile << endl;
@@ -110,6 +151,26 @@ void Disk::writeBlock(int blockNumber, void *buffer) {
     cerr << "Could not write file" << endl;
     exit(1);
   }
+  // a transaction's blocks are flushed together when it ends
+  if (isInTransaction) {
+    needsSync = true;
+  } else {
+    fsync(fd);
+  }
+  close(fd);
+  // after the write, so a reader that sees the old version read the block
+  // before it changed
+  writes.fetch_add(1);
+  dthread_mutex_unlock(&snapshotLock);
+}
+
+void Disk::sync() {
+  needsSync = false;
+  int fd = open(this->imageFile.c_str(), O_RDWR);
+  if (fd < 0) {
+    cerr << "Could not open image file " << this->imageFile << endl;
+    exit(1);
+  }
   fsync(fd);
   close(fd);
 }
@@ -123,20 +184,180 @@ void Disk::beginTransaction() {
 }
 
 void Disk::commit() {
+  diskStats.add(DISK_COMMITS);
   isInTransaction = false;
+  if (needsSync) {
+    sync();
+  }
   deque<struct UndoRecord>::iterator iter;
   for (iter = undoLog.begin(); iter != undoLog.end(); iter++) {
     delete [] iter->blockData;
   }
   undoLog.clear();
+  undoneBlocks.clear();
 }
 
 void Disk::rollback() {
-  isInTransaction = false;
+  diskStats.add(DISK_ROLLBACKS);
+  // restored while still in the transaction, so the restores don't log
+  // undo records of their own and are flushed together
   deque<struct UndoRecord>::iterator iter;
   for (iter = undoLog.begin(); iter != undoLog.end(); iter++) {
     this->writeBlock(iter->blockNumber, iter->blockData);
     delete [] iter->blockData;
   }
+  isInTransaction = false;
+  if (needsSync) {
+    sync();
+  }
   undoLog.clear();
+  undoneBlocks.clear();
+}
+
+void Disk::loadSnapshots() {
+  size_t slash = imageFile.rfind('/');
+  string directory = slash == string::npos ? "." : imageFile.substr(0, slash + 1);
+  string prefix = (slash == string::npos ? imageFile : imageFile.substr(slash + 1)) + SNAPSHOT_SUFFIX;
+  DIR *dir = opendir(directory.c_str());
+  if (dir == NULL) {
+    return;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    string fileName = entry->d_name;
+    if (fileName.size() <= prefix.size() || fileName.compare(0, prefix.size(), prefix) != 0) {
+      continue;
+    }
+    shared_ptr<DiskSnapshot> snapshot = make_shared<DiskSnapshot>();
+    snapshot->file = imageFile + SNAPSHOT_SUFFIX + fileName.substr(prefix.size());
+    snapshot->fd = open(snapshot->file.c_str(), O_RDWR);
+    if (snapshot->fd < 0) {
+      cerr << "Could not open snapshot " << snapshot->file << endl;
+      exit(1);
+    }
+
+    // a record torn by a crash part way through preserving its block is
+    // dropped, the block it was for was never overwritten
+    off_t recordSize = sizeof(int) + blockSize;
+    off_t fileSize = lseek(snapshot->fd, 0, SEEK_END);
+    snapshot->fileSize = fileSize - fileSize % recordSize;
+    if (snapshot->fileSize != fileSize && ftruncate(snapshot->fd, snapshot->fileSize) != 0) {
+      perror("snapshot::ftruncate");
+      exit(1);
+    }
+    for (off_t offset = 0; offset < snapshot->fileSize; offset += recordSize) {
+      int blockNumber;
+      if (pread(snapshot->fd, &blockNumber, sizeof(blockNumber), offset) != sizeof(blockNumber)) {
+        cerr << "Could not read snapshot " << snapshot->file << endl;
+        exit(1);
+      }
+      snapshot->preserved[blockNumber] = offset;
+    }
+    snapshotsByName[fileName.substr(prefix.size())] = snapshot;
+  }
+  closedir(dir);
+}
+
+void Disk::preserveBlock(int blockNumber) {
+  unsigned char *record = NULL;
+  map<string, shared_ptr<DiskSnapshot>>::iterator iter;
+  for (iter = snapshotsByName.begin(); iter != snapshotsByName.end(); iter++) {
+    DiskSnapshot *snapshot = iter->second.get();
+    if (snapshot->preserved.count(blockNumber) > 0) {
+      continue;
+    }
+    if (record == NULL) {
+      record = new unsigned char[sizeof(int) + blockSize];
+      memcpy(record, &blockNumber, sizeof(int));
+      this->readBlock(blockNumber, record + sizeof(int));
+    }
+    // durable before the block it saves is overwritten
+    ssize_t recordSize = sizeof(int) + blockSize;
+    if (pwrite(snapshot->fd, record, recordSize, snapshot->fileSize) != recordSize ||
+        fdatasync(snapshot->fd) != 0) {
+      cerr << "Could not write snapshot " << snapshot->file << endl;
+      exit(1);
+    }
+    snapshot->preserved[blockNumber] = snapshot->fileSize;
+    snapshot->fileSize += recordSize;
+  }
+  delete [] record;
+}
+
+// where the snapshot keeps its copy of blockNumber, or -1 if it has none
+off_t Disk::preservedOffset(DiskSnapshot *snapshot, int blockNumber) {
+  dthread_mutex_lock(&snapshotLock);
+  unordered_map<int, off_t>::iterator found = snapshot->preserved.find(blockNumber);
+  off_t offset = found == snapshot->preserved.end() ? -1 : found->second;
+  dthread_mutex_unlock(&snapshotLock);
+  return offset;
+}
+
+void Disk::readSnapshotBlock(DiskSnapshot *snapshot, int blockNumber, void *buffer) {
+  // The lock is only held to look the block up, so snapshot reads don't
+  // hold up live writes. A writer preserves a block before it overwrites
+  // it, both under the lock, so if the block still isn't preserved once
+  // we've read it from the image, nothing wrote it while we did.
+  off_t offset = preservedOffset(snapshot, blockNumber);
+  if (offset < 0) {
+    this->readBlock(blockNumber, buffer);
+    offset = preservedOffset(snapshot, blockNumber);
+  }
+  // preserved records are only ever appended, never rewritten
+  if (offset >= 0 && pread(snapshot->fd, buffer, blockSize, offset + sizeof(int)) != blockSize) {
+    cerr << "Could not read snapshot " << snapshot->file << endl;
+    exit(1);
+  }
+}
+
+bool Disk::createSnapshot(const string &name) {
+  dthread_mutex_lock(&snapshotLock);
+  bool created = false;
+  if (snapshotsByName.find(name) == snapshotsByName.end()) {
+    shared_ptr<DiskSnapshot> snapshot = make_shared<DiskSnapshot>();
+    snapshot->file = imageFile + SNAPSHOT_SUFFIX + name;
+    snapshot->fd = open(snapshot->file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (snapshot->fd < 0) {
+      cerr << "Could not create snapshot " << snapshot->file << endl;
+      exit(1);
+    }
+    snapshot->fileSize = 0;
+    snapshotsByName[name] = snapshot;
+    created = true;
+  }
+  dthread_mutex_unlock(&snapshotLock);
+  return created;
+}
+
+bool Disk::deleteSnapshot(const string &name) {
+  dthread_mutex_lock(&snapshotLock);
+  map<string, shared_ptr<DiskSnapshot>>::iterator found = snapshotsByName.find(name);
+  bool deleted = found != snapshotsByName.end();
+  if (deleted) {
+    // views still open keep the file descriptor until they're deleted
+    unlink(found->second->file.c_str());
+    snapshotsByName.erase(found);
+  }
+  dthread_mutex_unlock(&snapshotLock);
+  return deleted;
+}
+
+vector<string> Disk::snapshots() {
+  vector<string> names;
+  dthread_mutex_lock(&snapshotLock);
+  map<string, shared_ptr<DiskSnapshot>>::iterator iter;
+  for (iter = snapshotsByName.begin(); iter != snapshotsByName.end(); iter++) {
+    names.push_back(iter->first);
+  }
+  dthread_mutex_unlock(&snapshotLock);
+  return names;
+}
+
+Disk *Disk::openSnapshot(const string &name) {
+  dthread_mutex_lock(&snapshotLock);
+  map<string, shared_ptr<DiskSnapshot>>::iterator found = snapshotsByName.find(name);
+  Disk *view = found == snapshotsByName.end() ? NULL : new Disk(this, found->second);
+  dthread_mutex_unlock(&snapshotLock);
+  return view;
 }
@@ -7,30 +7,1369 @@
 #include <map>
 #include <string>
 #include <algorithm>
+#include <memory>
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
 
 #include "DistributedFileSystemService.h"
 #include "ClientError.h"
+#include "Metrics.h"
+#include "dthread.h"
+#include "http_parser.h"
 #include "ufs.h"
+#include "StringUtils.h"
 #include "WwwFormEncodedDict.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
 
 using namespace std;
 
-DistributedFileSystemService::DistributedFileSystemService(string diskFile) : HttpService("/ds3/")
+// points each shard gets on the hash ring
+static const int RING_POINTS = 64;
+// largest multi-PUT or multi-GET request body, and multi-GET answer
+static const size_t MAX_BATCH_BYTES = 16 * 1024 * 1024;
+// most paths one page of a recursive listing can have
+static const size_t MAX_LIST_KEYS = 1000;
+
+// 64 bit FNV-1a
+static uint64_t fnv1a(const char *data, size_t length) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t idx = 0; idx < length; idx++) {
+    hash ^= (unsigned char) data[idx];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+DistributedFileSystemService::DistributedFileSystemService(vector<string> diskFiles, size_t cacheBytes)
+  : HttpService("/ds3/"), cache(cacheBytes)
+{
+  replicator = NULL;
+  readOnly = false;
+  nextGeneration.store(((uint64_t) time(NULL) << 20) ^ getpid());
+  for (size_t idx = 0; idx < diskFiles.size(); idx++) {
+    Shard *shard = new Shard;
+    shard->fileSystem = new LocalFileSystem(new Disk(diskFiles[idx], UFS_BLOCK_SIZE));
+    pthread_mutex_init(&shard->writeLock, NULL);
+    pthread_mutex_init(&shard->inodesLock, NULL);
+    shard->inodesVersion = 0;
+    super_t super;
+    shard->fileSystem->readSuperBlock(&super);
+    shard->numInodes = super.num_inodes;
+    shard->generations.reset(new atomic<uint64_t>[shard->numInodes]);
+    for (int inodeNumber = 0; inodeNumber < shard->numInodes; inodeNumber++) {
+      shard->generations[inodeNumber].store(nextGeneration.load());
+    }
+    shards.push_back(shard);
+
+    // points come from the shard's position rather than its file name, so
+    // images can move without their objects changing shards
+    for (int point = 0; point < RING_POINTS; point++) {
+      string label = "shard-" + to_string(idx) + "-" + to_string(point);
+      ring.push_back(make_pair(fnv1a(label.data(), label.size()), (int) idx));
+    }
+  }
+  sort(ring.begin(), ring.end());
+
+  vector<Shard *> shards = this->shards;
+  Metrics::addCollector([shards](string &out) {
+    static const char *ops[NUM_FS_COUNTERS] = { "lookup", "stat", "read", "write", "create", "unlink", "rename", "copy" };
+    out += "# HELP gunrock_fs_operations_total LocalFileSystem calls by operation.\n";
+    out += "# TYPE gunrock_fs_operations_total counter\n";
+    for (size_t idx = 0; idx < shards.size(); idx++) {
+      FileSystemStats &fs = shards[idx]->fileSystem->stats();
+      for (size_t op = 0; op < NUM_FS_COUNTERS; op++) {
+        out += "gunrock_fs_operations_total{shard=\"" + to_string(idx) + "\",op=\"" + ops[op] + "\"} "
+          + to_string(fs.sum(op)) + "\n";
+      }
+    }
+    out += "# HELP gunrock_disk_block_reads_total Disk blocks read.\n";
+    out += "# TYPE gunrock_disk_block_reads_total counter\n";
+    for (size_t idx = 0; idx < shards.size(); idx++) {
+      DiskStats &disk = shards[idx]->fileSystem->disk->stats();
+      out += "gunrock_disk_block_reads_total{shard=\"" + to_string(idx) + "\"} "
+        + to_string(disk.sum(DISK_BLOCK_READS)) + "\n";
+    }
+    out += "# HELP gunrock_disk_block_writes_total Disk blocks written.\n";
+    out += "# TYPE gunrock_disk_block_writes_total counter\n";
+    for (size_t idx = 0; idx < shards.size(); idx++) {
+      DiskStats &disk = shards[idx]->fileSystem->disk->stats();
+      out += "gunrock_disk_block_writes_total{shard=\"" + to_string(idx) + "\"} "
+        + to_string(disk.sum(DISK_BLOCK_WRITES)) + "\n";
+    }
+    out += "# HELP gunrock_disk_transactions_total Disk transactions by outcome.\n";
+    out += "# TYPE gunrock_disk_transactions_total counter\n";
+    for (size_t idx = 0; idx < shards.size(); idx++) {
+      DiskStats &disk = shards[idx]->fileSystem->disk->stats();
+      string shard = "shard=\"" + to_string(idx) + "\"";
+      out += "gunrock_disk_transactions_total{" + shard + ",outcome=\"commit\"} "
+        + to_string(disk.sum(DISK_COMMITS)) + "\n";
+      out += "gunrock_disk_transactions_total{" + shard + ",outcome=\"rollback\"} "
+        + to_string(disk.sum(DISK_ROLLBACKS)) + "\n";
+    }
+  });
+}
+
+// Holds a mutex for a scope, so a ClientError thrown part way through an
+// operation still releases it.
+class MutexLock {
+ public:
+  MutexLock(pthread_mutex_t *lock) : lock(lock) { dthread_mutex_lock(lock); }
+  ~MutexLock() { dthread_mutex_unlock(lock); }
+
+ private:
+  pthread_mutex_t *lock;
+};
+
+// A disk transaction that rolls back unless it is committed before it
+// goes out of scope.
+class Transaction {
+ public:
+  Transaction(Disk *disk) : disk(disk), committed(false) { disk->beginTransaction(); }
+  ~Transaction() {
+    if (!committed) {
+      disk->rollback();
+    }
+  }
+  void commit() {
+    disk->commit();
+    committed = true;
+  }
+
+ private:
+  Disk *disk;
+  bool committed;
+};
+
+// A shard's file system as of a snapshot, or the live one when snapshot
+// is empty. Snapshots never change, so reading one takes no path locks.
+class ShardView {
+ public:
+  ShardView(LocalFileSystem *live, const string &snapshot) : fileSystem(live) {
+    if (!snapshot.empty()) {
+      disk.reset(live->disk->openSnapshot(snapshot));
+      if (disk == NULL) {
+        throw ClientError::notFound();
+      }
+      view = make_unique<LocalFileSystem>(disk.get());
+      fileSystem = view.get();
+    }
+  }
+
+  LocalFileSystem *fileSystem;
+
+ private:
+  unique_ptr<Disk> disk;
+  unique_ptr<LocalFileSystem> view;
+};
+
+// the inode alone doesn't change when a file is rewritten
+static string contentEtag(int inodeNumber, const string &data) {
+  char etag[64];
+  snprintf(etag, sizeof(etag), "\"%x-%lx\"", inodeNumber,
+           (unsigned long) fnv1a(data.data(), data.size()));
+  return etag;
+}
+
+// how paths are written in the cache and the replication log
+static string joinPath(const vector<string> &path) {
+  string joined;
+  for (size_t idx = 0; idx < path.size(); idx++) {
+    if (idx > 0) {
+      joined += "/";
+    }
+    joined += path[idx];
+  }
+  return joined;
+}
+
+// names that can be a directory entry and aren't . or ..
+static bool validName(string_view name) {
+  return !name.empty() && name != "." && name != ".." && name.size() < DIR_ENT_NAME_SIZE;
+}
+
+vector<string> DistributedFileSystemService::objectPath(HTTPRequest *request)
+{
+  pmr::vector<string_view> views = request->getPathViews();
+  vector<string> components;
+  // skip the "ds3" that every path starts with
+  for (size_t idx = 1; idx < views.size(); idx++) {
+    string_view name = views[idx];
+    if (!validName(name)) {
+      throw ClientError::badRequest();
+    }
+    components.push_back(string(name));
+  }
+  return components;
+}
+
+size_t DistributedFileSystemService::shardIndex(const string &name)
 {
-  this->fileSystem = new LocalFileSystem(new Disk(diskFile, UFS_BLOCK_SIZE));
+  uint64_t hash = fnv1a(name.data(), name.size());
+  vector<pair<uint64_t, int>>::iterator point =
+    lower_bound(ring.begin(), ring.end(), make_pair(hash, 0));
+  if (point == ring.end()) {
+    point = ring.begin();
+  }
+  return point->second;
+}
+
+DistributedFileSystemService::Shard *DistributedFileSystemService::shardFor(const string &name)
+{
+  return shards[shardIndex(name)];
+}
+
+int DistributedFileSystemService::resolve(LocalFileSystem *fileSystem, const vector<string> &components, size_t count)
+{
+  int inodeNumber = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  for (size_t idx = 0; idx < count; idx++) {
+    // a regular file in the middle of the path fails here as well
+    inodeNumber = fileSystem->lookup(inodeNumber, components[idx]);
+    if (inodeNumber < 0) {
+      throw ClientError::notFound();
+    }
+  }
+  return inodeNumber;
+}
+
+size_t DistributedFileSystemService::existingDepth(LocalFileSystem *fileSystem, const vector<string> &components)
+{
+  int inodeNumber = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  size_t depth = 0;
+  while (depth < components.size()) {
+    inodeNumber = fileSystem->lookup(inodeNumber, components[depth]);
+    if (inodeNumber < 0) {
+      break;
+    }
+    depth++;
+  }
+  return depth;
+}
+
+// the entries of a directory other than . and ..
+static vector<dir_ent_t> readEntries(LocalFileSystem *fileSystem, int inodeNumber, inode_t &inode) {
+  vector<dir_ent_t> entries(inode.size / sizeof(dir_ent_t));
+  int ret = fileSystem->read(inodeNumber, entries.data(), entries.size() * sizeof(dir_ent_t));
+  if (ret < 0) {
+    throw ClientError::badRequest();
+  }
+  entries.resize(ret / sizeof(dir_ent_t));
+
+  vector<dir_ent_t> children;
+  for (size_t idx = 0; idx < entries.size(); idx++) {
+    if (strncmp(entries[idx].name, ".", DIR_ENT_NAME_SIZE) != 0 &&
+        strncmp(entries[idx].name, "..", DIR_ENT_NAME_SIZE) != 0) {
+      children.push_back(entries[idx]);
+    }
+  }
+  return children;
+}
+
+static string entryName(const dir_ent_t &entry) {
+  return string(entry.name, strnlen(entry.name, DIR_ENT_NAME_SIZE));
+}
+
+void DistributedFileSystemService::listDirectory(LocalFileSystem *fileSystem, int inodeNumber, inode_t &inode,
+                                                 vector<ObjectCache::Child> &children)
+{
+  vector<dir_ent_t> entries = readEntries(fileSystem, inodeNumber, inode);
+  for (size_t idx = 0; idx < entries.size(); idx++) {
+    inode_t entry;
+    if (fileSystem->stat(entries[idx].inum, &entry) != 0) {
+      throw ClientError::badRequest();
+    }
+    ObjectCache::Child child;
+    child.name = entryName(entries[idx]);
+    child.directory = entry.type == UFS_DIRECTORY;
+    child.size = entry.size;
+    child.inodeNumber = entries[idx].inum;
+    children.push_back(child);
+  }
+}
+
+// directories with a trailing /
+static string listingName(const ObjectCache::Child &child) {
+  return child.directory ? child.name + "/" : child.name;
+}
+
+// sorts the children, and lists them one name per line
+static string formatListing(vector<ObjectCache::Child> &children) {
+  sort(children.begin(), children.end(), [](const ObjectCache::Child &a, const ObjectCache::Child &b) {
+    return listingName(a) < listingName(b);
+  });
+  string listing;
+  for (size_t idx = 0; idx < children.size(); idx++) {
+    listing += listingName(children[idx]);
+    listing += "\n";
+  }
+  return listing;
+}
+
+static void writeJsonEntry(rapidjson::Writer<rapidjson::StringBuffer> &writer, const string &name, bool directory,
+                           int size, int inodeNumber) {
+  writer.Key("name");
+  writer.String(name.data(), name.size());
+  writer.Key("type");
+  writer.String(directory ? "directory" : "file");
+  writer.Key("size");
+  writer.Int(size);
+  writer.Key("inode");
+  writer.Int(inodeNumber);
+}
+
+// The JSON for an object, and for a directory's entries when withEntries.
+// The SAX writer goes straight into a buffer each thread reuses.
+static string formatJson(const string &name, const ObjectCache::Entry &object, bool withEntries) {
+  static thread_local rapidjson::StringBuffer buffer;
+  buffer.Clear();
+  rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+  writer.StartObject();
+  writeJsonEntry(writer, name, object.directory, object.size, object.inodeNumber);
+  if (withEntries && object.directory) {
+    writer.Key("entries");
+    writer.StartArray();
+    for (size_t idx = 0; idx < object.children.size(); idx++) {
+      const ObjectCache::Child &child = object.children[idx];
+      writer.StartObject();
+      writeJsonEntry(writer, child.name, child.directory, child.size, child.inodeNumber);
+      writer.EndObject();
+    }
+    writer.EndArray();
+  }
+  writer.EndObject();
+  return string(buffer.GetString(), buffer.GetSize());
+}
+
+void DistributedFileSystemService::listRoot(ObjectCache::Entry &object, const string &snapshot)
+{
+  object.size = 0;
+  for (size_t idx = 0; idx < shards.size(); idx++) {
+    // shards are locked one at a time, a writer only ever holds locks on
+    // its own shard so this can't deadlock with one
+    Shard *shard = shards[idx];
+    ShardView shardView(shard->fileSystem, snapshot);
+    vector<PathLockTable::Lock> locks;
+    PathLockTable::plan(vector<string>(), 0, PathLockTable::S, locks);
+    PathLockGuard held(&shard->pathLocks);
+    if (snapshot.empty()) {
+      held.acquire(locks);
+    }
+    inode_t inode;
+    if (shardView.fileSystem->stat(UFS_ROOT_DIRECTORY_INODE_NUMBER, &inode) != 0) {
+      throw ClientError::notFound();
+    }
+    // the roots together, entry numbers are only unique within a shard
+    object.size += inode.size;
+    listDirectory(shardView.fileSystem, UFS_ROOT_DIRECTORY_INODE_NUMBER, inode, object.children);
+  }
+  object.body = formatListing(object.children);
+}
+
+static bool startsWith(const string &value, const string &prefix) {
+  return value.compare(0, prefix.size(), prefix) == 0;
+}
+
+// A directory's entries read straight from its data blocks, for walks
+// that already have the inode table in memory.
+static vector<dir_ent_t> directoryEntries(Disk *disk, const inode_t &inode) {
+  vector<dir_ent_t> entries;
+  unsigned char block[UFS_BLOCK_SIZE];
+  int remaining = inode.size;
+  for (int idx = 0; idx < DIRECT_PTRS && remaining > 0; idx++) {
+    disk->readBlock(inode.direct[idx], block);
+    int length = min(remaining, UFS_BLOCK_SIZE);
+    dir_ent_t *blockEntries = (dir_ent_t *) block;
+    for (size_t entry = 0; entry < length / sizeof(dir_ent_t); entry++) {
+      if (strncmp(blockEntries[entry].name, ".", DIR_ENT_NAME_SIZE) != 0 &&
+          strncmp(blockEntries[entry].name, "..", DIR_ENT_NAME_SIZE) != 0) {
+        entries.push_back(blockEntries[entry]);
+      }
+    }
+    remaining -= length;
+  }
+  return entries;
+}
+
+// Adds the keys under the directory inodeNumber in sorted order, stopping
+// once there's one more than a page. Siblings are sorted with the / on
+// directories, which puts every key under a directory before the sibling
+// that follows it, so the walk comes out sorted and whole subtrees that
+// fall before start-after or outside the prefix can be skipped.
+static void walkSubtree(Disk *disk, const vector<inode_t> &inodes, int inodeNumber, const string &base,
+                        int depth, const DistributedFileSystemService::ListQuery &query, vector<string> &keys) {
+  vector<dir_ent_t> entries = directoryEntries(disk, inodes[inodeNumber]);
+  vector<pair<string, int>> children;
+  for (size_t idx = 0; idx < entries.size(); idx++) {
+    if (entries[idx].inum < 0 || entries[idx].inum >= (int) inodes.size()) {
+      throw ClientError::badRequest();
+    }
+    string key = base + entryName(entries[idx]);
+    if (inodes[entries[idx].inum].type == UFS_DIRECTORY) {
+      key += "/";
+    }
+    children.push_back(make_pair(key, entries[idx].inum));
+  }
+  sort(children.begin(), children.end());
+
+  for (size_t idx = 0; idx < children.size() && keys.size() <= query.maxKeys; idx++) {
+    const string &key = children[idx].first;
+    if (key > query.startAfter && startsWith(key, query.prefix)) {
+      keys.push_back(key);
+    }
+    bool directory = key.back() == '/';
+    if (directory && depth != 1 &&
+        (key > query.startAfter || startsWith(query.startAfter, key)) &&
+        (startsWith(key, query.prefix) || startsWith(query.prefix, key))) {
+      walkSubtree(disk, inodes, children[idx].second, key, depth - 1, query, keys);
+    }
+  }
+}
+
+shared_ptr<const vector<inode_t>> DistributedFileSystemService::inodeTable(Shard *shard, LocalFileSystem *fileSystem,
+                                                                        const string &snapshot)
+{
+  Disk *disk = shard->fileSystem->disk;
+  uint64_t version = disk->writeVersion();
+  if (snapshot.empty()) {
+    MutexLock locked(&shard->inodesLock);
+    if (shard->inodes != NULL && shard->inodesVersion == version) {
+      return shard->inodes;
+    }
+  }
+
+  super_t super;
+  fileSystem->readSuperBlock(&super);
+  shared_ptr<vector<inode_t>> inodes =
+    make_shared<vector<inode_t>>(super.inode_region_len * UFS_BLOCK_SIZE / sizeof(inode_t));
+  fileSystem->readInodeRegion(&super, inodes->data());
+  inodes->resize(min((size_t) super.num_inodes, inodes->size()));
+
+  // a write that landed while we were reading leaves a table that may be
+  // half old and half new, good enough for this walk but not to keep
+  if (snapshot.empty() && disk->writeVersion() == version) {
+    MutexLock locked(&shard->inodesLock);
+    shard->inodes = inodes;
+    shard->inodesVersion = version;
+  }
+  return inodes;
+}
+
+void DistributedFileSystemService::listSubtree(Shard *shard, const vector<string> &path, const ListQuery &query,
+                                               vector<string> &keys)
+{
+  // the S lock on path covers everything under it
+  ShardView shardView(shard->fileSystem, query.snapshot);
+  LocalFileSystem *fileSystem = shardView.fileSystem;
+  vector<PathLockTable::Lock> locks;
+  PathLockTable::plan(path, path.size(), PathLockTable::S, locks);
+  PathLockGuard held(&shard->pathLocks);
+  if (query.snapshot.empty()) {
+    held.acquire(locks);
+  }
+  int inodeNumber = resolve(fileSystem, path, path.size());
+
+  // one inode table for the whole walk, instead of a stat for every
+  // entry, and the same one for every page until something is written
+  shared_ptr<const vector<inode_t>> table = inodeTable(shard, fileSystem, query.snapshot);
+  const vector<inode_t> &inodes = *table;
+  if (inodeNumber < 0 || inodeNumber >= (int) inodes.size()) {
+    throw ClientError::notFound();
+  }
+  if (inodes[inodeNumber].type != UFS_DIRECTORY) {
+    throw ClientError::badRequest();
+  }
+  walkSubtree(fileSystem->disk, inodes, inodeNumber, "", query.depth, query, keys);
+}
+
+void DistributedFileSystemService::listRecursive(HTTPRequest *request, HTTPResponse *response,
+                                                 const vector<string> &path)
+{
+  map<string, string> params = request->getParams();
+  ListQuery query;
+  query.snapshot = params["snapshot"];
+  query.prefix = params["prefix"];
+  query.startAfter = params["start-after"];
+  query.maxKeys = MAX_LIST_KEYS;
+  if (params.count("max-keys")) {
+    int maxKeys = atoi(params["max-keys"].c_str());
+    if (maxKeys < 0) {
+      throw ClientError::badRequest();
+    }
+    query.maxKeys = min((size_t) maxKeys, MAX_LIST_KEYS);
+  }
+  // 0 is no limit
+  query.depth = 0;
+  if (params.count("depth")) {
+    query.depth = atoi(params["depth"].c_str());
+    if (query.depth < 1) {
+      throw ClientError::badRequest();
+    }
+  }
+
+  vector<string> keys;
+  if (path.empty()) {
+    // one shard at a time, like listRoot
+    for (size_t idx = 0; idx < shards.size(); idx++) {
+      listSubtree(shards[idx], path, query, keys);
+    }
+    sort(keys.begin(), keys.end());
+  } else {
+    listSubtree(shardFor(path[0]), path, query, keys);
+  }
+
+  if (keys.size() > query.maxKeys) {
+    keys.resize(query.maxKeys);
+    if (!keys.empty()) {
+      response->setHeader("X-Next-Start-After", keys.back());
+    }
+  }
+  string listing;
+  for (size_t idx = 0; idx < keys.size(); idx++) {
+    listing += keys[idx];
+    listing += "\n";
+  }
+  response->setContentType("text/plain; charset=utf-8");
+  response->setBody(listing);
 }
 
 void DistributedFileSystemService::get(HTTPRequest *request, HTTPResponse *response)
 {
-  response->setBody("");
+  vector<string> path = objectPath(request);
+  map<string, string> params = request->getParams();
+  if (params["recursive"] == "1" || params["recursive"] == "true") {
+    listRecursive(request, response, path);
+    return;
+  }
+  if (path.empty() && (params["snapshots"] == "1" || params["snapshots"] == "true")) {
+    response->setContentType("text/plain; charset=utf-8");
+    response->setBody(listSnapshots());
+    return;
+  }
+  bool metadata = params["metadata"] == "1" || params["metadata"] == "true";
+  // the cache only holds the live file system
+  shared_ptr<const ObjectCache::Entry> object;
+  if (!params["snapshot"].empty()) {
+    object = readObject(path, params["snapshot"]);
+  } else if (!path.empty() && !metadata && request->hasHeader("Range")) {
+    // a range of an object that isn't cached only reads the blocks it
+    // covers, and leaves the cache alone
+    object = cache.lookup(joinPath(path));
+    if (object == NULL && getRanges(request, response, path)) {
+      return;
+    }
+  }
+  if (object == NULL) {
+    object = lookupObject(path);
+  }
+
+  if (object->directory) {
+    response->setHeader("Vary", "Accept");
+  }
+  bool json = object->directory && request->hasHeader("Accept") &&
+    request->getHeader("Accept").find("application/json") != string::npos;
+  if (metadata || json) {
+    string json = formatJson(path.empty() ? "" : path.back(), *object, !metadata);
+    if (this->notModified(request, response, contentEtag(object->inodeNumber, json))) {
+      return;
+    }
+    response->setContentType("application/json");
+    response->setBody(json);
+    return;
+  }
+
+  if (this->notModified(request, response, object->etag)) {
+    return;
+  }
+
+  if (object->directory) {
+    response->setContentType("text/plain; charset=utf-8");
+    response->setBody(object->body);
+    return;
+  }
+
+  const string &body = object->body;
+  response->setContentType("application/octet-stream");
+  vector<ByteRange> ranges;
+  if (this->rangeRequested(request, response, body.size(), object->etag, ranges)) {
+    vector<string> parts;
+    for (size_t idx = 0; idx < ranges.size(); idx++) {
+      parts.push_back(body.substr(ranges[idx].first, ranges[idx].last - ranges[idx].first + 1));
+    }
+    response->setPartialBody(ranges, parts, body.size());
+    return;
+  }
+  // Unlike FileService's big files, objects aren't streamed with
+  // writeChunk. None is larger than MAX_FILE_SIZE (120 KiB), the cache
+  // holds them whole anyway, and streaming from the disk would keep the
+  // path's S lock, and its writers waiting, for as long as a slow client
+  // takes to read. Ranges of uncached files are read block by block
+  // instead, in getRanges.
+  response->setBody(body);
+}
+
+bool DistributedFileSystemService::getRanges(HTTPRequest *request, HTTPResponse *response,
+                                            const vector<string> &path)
+{
+  Shard *shard = shardFor(path[0]);
+  LocalFileSystem *fileSystem = shard->fileSystem;
+  vector<PathLockTable::Lock> locks;
+  PathLockTable::plan(path, path.size(), PathLockTable::S, locks);
+  PathLockGuard held(&shard->pathLocks, locks);
+  int inodeNumber = resolve(fileSystem, path, path.size());
+  inode_t inode;
+  if (fileSystem->stat(inodeNumber, &inode) != 0) {
+    throw ClientError::notFound();
+  }
+  if (inode.type == UFS_DIRECTORY) {
+    return false;
+  }
+
+  string etag = fileEtag(shard, inodeNumber);
+  if (this->notModified(request, response, etag)) {
+    return true;
+  }
+  vector<ByteRange> ranges;
+  if (!this->rangeRequested(request, response, inode.size, etag, ranges)) {
+    return false;
+  }
+  response->setContentType("application/octet-stream");
+  vector<string> parts;
+  // HEAD only needs the lengths
+  for (size_t idx = 0; idx < ranges.size() && !request->isHead(); idx++) {
+    string part(ranges[idx].last - ranges[idx].first + 1, '\0');
+    int ret = fileSystem->readAt(inodeNumber, part.data(), part.size(), ranges[idx].first);
+    if (ret != (int) part.size()) {
+      throw ClientError::badRequest();
+    }
+    parts.push_back(part);
+  }
+  response->setPartialBody(ranges, parts, inode.size);
+  return true;
+}
+
+shared_ptr<const ObjectCache::Entry> DistributedFileSystemService::lookupObject(const vector<string> &path)
+{
+  string key = joinPath(path);
+  // hits don't touch the file system or take any path locks
+  shared_ptr<const ObjectCache::Entry> object = cache.lookup(key);
+  if (object == NULL) {
+    uint64_t version = cache.version();
+    object = readObject(path);
+    cache.insert(key, object, version);
+  }
+  return object;
+}
+
+shared_ptr<const ObjectCache::Entry> DistributedFileSystemService::readObject(const vector<string> &path,
+                                                                            const string &snapshot)
+{
+  shared_ptr<ObjectCache::Entry> object = make_shared<ObjectCache::Entry>();
+  int inodeNumber;
+  string etag;
+  if (path.empty()) {
+    inodeNumber = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+    object->directory = true;
+    listRoot(*object, snapshot);
+  } else {
+    Shard *shard = shardFor(path[0]);
+    ShardView shardView(shard->fileSystem, snapshot);
+    LocalFileSystem *fileSystem = shardView.fileSystem;
+    vector<PathLockTable::Lock> locks;
+    PathLockTable::plan(path, path.size(), PathLockTable::S, locks);
+    PathLockGuard held(&shard->pathLocks);
+    if (snapshot.empty()) {
+      held.acquire(locks);
+    }
+    inodeNumber = resolve(fileSystem, path, path.size());
+    inode_t inode;
+    if (fileSystem->stat(inodeNumber, &inode) != 0) {
+      throw ClientError::notFound();
+    }
+    object->directory = inode.type == UFS_DIRECTORY;
+    object->size = inode.size;
+    if (object->directory) {
+      listDirectory(fileSystem, inodeNumber, inode, object->children);
+      object->body = formatListing(object->children);
+    } else {
+      object->body.resize(inode.size);
+      int ret = fileSystem->read(inodeNumber, object->body.data(), inode.size);
+      if (ret < 0) {
+        throw ClientError::badRequest();
+      }
+      object->body.resize(ret);
+      // snapshots don't track generations, and their files never change
+      if (snapshot.empty()) {
+        etag = fileEtag(shard, inodeNumber);
+      }
+    }
+  }
+  object->inodeNumber = inodeNumber;
+  object->etag = etag.empty() ? contentEtag(inodeNumber, object->body) : etag;
+  return object;
+}
+
+void DistributedFileSystemService::invalidate(const vector<string> &path, size_t fromDepth)
+{
+  // the listing above the first changed directory holds its size, which
+  // changes when it gains or loses an entry
+  if (fromDepth > 0) {
+    fromDepth--;
+  }
+  vector<string> prefix(path.begin(), path.begin() + fromDepth);
+  cache.invalidate(joinPath(prefix));
+  for (size_t idx = fromDepth; idx < path.size(); idx++) {
+    prefix.push_back(path[idx]);
+    cache.invalidate(joinPath(prefix));
+  }
+}
+
+void DistributedFileSystemService::head(HTTPRequest *request, HTTPResponse *response)
+{
+  // the framework drops the body of HEAD responses
+  get(request, response);
+}
+
+void DistributedFileSystemService::replicateTo(Replicator *replicator)
+{
+  this->replicator = replicator;
+}
+
+void DistributedFileSystemService::setReadOnly(bool readOnly)
+{
+  this->readOnly = readOnly;
 }
 
 void DistributedFileSystemService::put(HTTPRequest *request, HTTPResponse *response)
 {
+  if (readOnly) {
+    throw ClientError::forbidden();
+  }
+  vector<string> path = objectPath(request);
+  if (path.empty()) {
+    throw ClientError::badRequest();
+  }
+
+  // objects can't be larger than MAX_FILE_SIZE, so reject big uploads
+  // from their Content-Length before reading any of the body
+  BufferedBodySink body(MAX_FILE_SIZE, request->getContentLength());
+  request->readBody(&body);
+
+  uint64_t lsn = putObject(path, body.body());
+  if (replicator != NULL) {
+    replicator->waitForBackups(lsn);
+  }
   response->setBody("");
 }
 
+size_t DistributedFileSystemService::lockSubtree(Shard *shard, const vector<string> &prefix, PathLockGuard &held)
+{
+  size_t lockDepth = prefix.size();
+  while (true) {
+    vector<PathLockTable::Lock> locks;
+    PathLockTable::plan(prefix, lockDepth, PathLockTable::X, locks);
+    held.acquire(locks);
+
+    size_t existing = existingDepth(shard->fileSystem, prefix);
+    if (existing >= lockDepth) {
+      return existing;
+    }
+    held.release();
+    lockDepth = existing;
+  }
+}
+
+void DistributedFileSystemService::writeObject(Shard *shard, const vector<string> &path, const string &data)
+{
+  LocalFileSystem *fileSystem = shard->fileSystem;
+  // create returns the existing directory if there is one, so this makes
+  // any missing directories in the same single walk down the path
+  int parent = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  for (size_t idx = 0; idx + 1 < path.size(); idx++) {
+    parent = fileSystem->create(parent, UFS_DIRECTORY, path[idx]);
+    if (parent == -EINVALIDTYPE) {
+      // there's a file where we need a directory
+      throw ClientError::conflict();
+    } else if (parent == -ENOTENOUGHSPACE) {
+      throw ClientError::insufficientStorage();
+    } else if (parent < 0) {
+      throw ClientError::badRequest();
+    }
+  }
+
+  int inodeNumber = fileSystem->create(parent, UFS_REGULAR_FILE, path.back());
+  if (inodeNumber == -ENOTENOUGHSPACE) {
+    throw ClientError::insufficientStorage();
+  } else if (inodeNumber < 0) {
+    throw ClientError::badRequest();
+  }
+
+  touchFile(shard, inodeNumber);
+  int ret = fileSystem->write(inodeNumber, data.data(), data.size());
+  if (ret == -ENOTENOUGHSPACE) {
+    throw ClientError::insufficientStorage();
+  } else if (ret < 0) {
+    throw ClientError::badRequest();
+  }
+}
+
+uint64_t DistributedFileSystemService::putObject(const vector<string> &path, const string &data)
+{
+  Shard *shard = shardFor(path[0]);
+  PathLockGuard held(&shard->pathLocks);
+  size_t existing = lockSubtree(shard, path, held);
+
+  {
+    MutexLock writing(&shard->writeLock);
+    Transaction transaction(shard->fileSystem->disk);
+    writeObject(shard, path, data);
+    transaction.commit();
+  }
+
+  // the file and its parent's listing, and if directories were made, the
+  // listing of the one that gained the first of them
+  invalidate(path, min(existing, path.size() - 1));
+
+  // logged while the path is still locked, so writes to the same path
+  // reach the log in the order they were applied
+  return replicator != NULL ? replicator->logged(HTTP_PUT, joinPath(path), data) : 0;
+}
+
+void DistributedFileSystemService::post(HTTPRequest *request, HTTPResponse *response)
+{
+  vector<string> prefix = objectPath(request);
+  map<string, string> params = request->getParams();
+  string batch = params["batch"];
+  if (prefix.empty() && params.count("snapshot")) {
+    createSnapshot(params["snapshot"]);
+    response->setBody("");
+  } else if (batch == "put") {
+    putBatch(request, response, prefix);
+  } else if (batch == "get") {
+    getBatch(request, response, prefix);
+  } else {
+    throw ClientError::badRequest();
+  }
+}
+
+// prefix plus the components of a path relative to it
+static vector<string> batchPath(const vector<string> &prefix, const string &relative) {
+  vector<string> path = prefix;
+  vector<string> components = StringUtils::split(relative, '/');
+  for (size_t idx = 0; idx < components.size(); idx++) {
+    if (!validName(components[idx])) {
+      throw ClientError::badRequest();
+    }
+    path.push_back(components[idx]);
+  }
+  if (path.size() == prefix.size()) {
+    throw ClientError::badRequest();
+  }
+  return path;
+}
+
+void DistributedFileSystemService::putBatch(HTTPRequest *request, HTTPResponse *response,
+                                            const vector<string> &prefix)
+{
+  if (readOnly) {
+    throw ClientError::forbidden();
+  }
+  BufferedBodySink body(MAX_BATCH_BYTES, request->getContentLength());
+  request->readBody(&body);
+  const string &batch = body.body();
+
+  vector<vector<string>> paths;
+  vector<string> objects;
+  size_t offset = 0;
+  while (offset < batch.size()) {
+    size_t newline = batch.find('\n', offset);
+    size_t pathLength, bodyLength;
+    if (newline == string::npos ||
+        sscanf(batch.substr(offset, newline - offset).c_str(), "%zu %zu", &pathLength, &bodyLength) != 2) {
+      throw ClientError::badRequest();
+    }
+    size_t start = newline + 1;
+    if (pathLength > batch.size() - start || bodyLength > batch.size() - start - pathLength) {
+      throw ClientError::badRequest();
+    }
+    if (bodyLength > MAX_FILE_SIZE) {
+      throw ClientError::payloadTooLarge();
+    }
+    paths.push_back(batchPath(prefix, batch.substr(start, pathLength)));
+    objects.push_back(batch.substr(start + pathLength, bodyLength));
+    offset = start + pathLength + bodyLength;
+  }
+
+  // The prefix is locked on every shard the batch touches, in shard
+  // order so that two batches can't deadlock. With an empty prefix that
+  // is each shard's root.
+  map<size_t, vector<size_t>> byShard;
+  for (size_t idx = 0; idx < paths.size(); idx++) {
+    byShard[shardIndex(paths[idx][0])].push_back(idx);
+  }
+  vector<unique_ptr<PathLockGuard>> held;
+  map<size_t, size_t> existing;
+  for (map<size_t, vector<size_t>>::iterator group = byShard.begin(); group != byShard.end(); group++) {
+    Shard *shard = shards[group->first];
+    held.push_back(make_unique<PathLockGuard>(&shard->pathLocks));
+    existing[group->first] = lockSubtree(shard, prefix, *held.back());
+  }
+
+  {
+    // one transaction per shard, and none commit unless every object was
+    // written, so a failure anywhere leaves every image as it was
+    vector<unique_ptr<MutexLock>> writing;
+    vector<unique_ptr<Transaction>> transactions;
+    for (map<size_t, vector<size_t>>::iterator group = byShard.begin(); group != byShard.end(); group++) {
+      Shard *shard = shards[group->first];
+      writing.push_back(make_unique<MutexLock>(&shard->writeLock));
+      transactions.push_back(make_unique<Transaction>(shard->fileSystem->disk));
+      for (size_t idx = 0; idx < group->second.size(); idx++) {
+        size_t object = group->second[idx];
+        writeObject(shard, paths[object], objects[object]);
+      }
+    }
+    for (size_t idx = 0; idx < transactions.size(); idx++) {
+      transactions[idx]->commit();
+    }
+  }
+
+  uint64_t lsn = 0;
+  for (size_t idx = 0; idx < paths.size(); idx++) {
+    invalidate(paths[idx], existing[shardIndex(paths[idx][0])]);
+    if (replicator != NULL) {
+      lsn = replicator->logged(HTTP_PUT, joinPath(paths[idx]), objects[idx]);
+    }
+  }
+  held.clear();
+
+  if (replicator != NULL) {
+    replicator->waitForBackups(lsn);
+  }
+  response->setBody("");
+}
+
+void DistributedFileSystemService::getBatch(HTTPRequest *request, HTTPResponse *response,
+                                            const vector<string> &prefix)
+{
+  BufferedBodySink body(MAX_BATCH_BYTES, request->getContentLength());
+  request->readBody(&body);
+  vector<string> requested = StringUtils::split(body.body(), '\n');
+
+  string batch;
+  for (size_t idx = 0; idx < requested.size(); idx++) {
+    // each object is read on its own, a batch isn't a snapshot
+    int status = 200;
+    shared_ptr<const ObjectCache::Entry> object;
+    try {
+      object = lookupObject(batchPath(prefix, requested[idx]));
+    } catch (ClientError &ce) {
+      status = ce.status_code;
+    }
+    const string &relative = requested[idx];
+    size_t bodyLength = object != NULL ? object->body.size() : 0;
+    char header[64];
+    snprintf(header, sizeof(header), "%zu %d %zu\n", relative.size(), status, bodyLength);
+    // many paths naming one big file would otherwise build an answer
+    // far bigger than the request
+    if (batch.size() + strlen(header) + relative.size() + bodyLength > MAX_BATCH_BYTES) {
+      throw ClientError::payloadTooLarge();
+    }
+    batch += header;
+    batch += relative;
+    if (object != NULL) {
+      batch += object->body;
+    }
+  }
+  response->setContentType("application/octet-stream");
+  response->setBody(batch);
+}
+
 void DistributedFileSystemService::del(HTTPRequest *request, HTTPResponse *response)
 {
+  vector<string> path = objectPath(request);
+  map<string, string> params = request->getParams();
+  if (path.empty() && params.count("snapshot")) {
+    deleteSnapshot(params["snapshot"]);
+    response->setBody("");
+    return;
+  }
+  if (readOnly) {
+    throw ClientError::forbidden();
+  }
+  if (path.empty()) {
+    // the root can't be deleted
+    throw ClientError::badRequest();
+  }
+  string recursive = params["recursive"];
+
+  uint64_t lsn = deleteObject(path, recursive == "1" || recursive == "true");
+  if (replicator != NULL) {
+    replicator->waitForBackups(lsn);
+  }
+  response->setBody("");
+}
+
+// Unlinks path from parent, and when recursive everything under it first,
+// adding what it removed to removed in the order it went.
+static void removeEntry(LocalFileSystem *fileSystem, int parent, const vector<string> &path, bool recursive,
+                        vector<vector<string>> &removed) {
+  if (recursive) {
+    int inodeNumber = fileSystem->lookup(parent, path.back());
+    inode_t inode;
+    if (inodeNumber >= 0 && fileSystem->stat(inodeNumber, &inode) == 0 && inode.type == UFS_DIRECTORY) {
+      vector<dir_ent_t> entries = readEntries(fileSystem, inodeNumber, inode);
+      for (size_t idx = 0; idx < entries.size(); idx++) {
+        vector<string> child = path;
+        child.push_back(entryName(entries[idx]));
+        removeEntry(fileSystem, inodeNumber, child, true, removed);
+      }
+    }
+  }
+
+  int ret = fileSystem->unlink(parent, path.back());
+  if (ret == -ENOTFOUND) {
+    throw ClientError::notFound();
+  } else if (ret < 0) {
+    // including directories that aren't empty
+    throw ClientError::badRequest();
+  }
+  removed.push_back(path);
+}
+
+uint64_t DistributedFileSystemService::deleteObject(const vector<string> &path, bool recursive)
+{
+  // unlinking rewrites the parent's entries, and the lock on the parent
+  // covers everything under path too
+  Shard *shard = shardFor(path[0]);
+  LocalFileSystem *fileSystem = shard->fileSystem;
+  vector<PathLockTable::Lock> locks;
+  PathLockTable::plan(path, path.size() - 1, PathLockTable::X, locks);
+  PathLockGuard held(&shard->pathLocks, locks);
+
+  int parent = resolve(fileSystem, path, path.size() - 1);
+  if (fileSystem->lookup(parent, path.back()) < 0) {
+    throw ClientError::notFound();
+  }
+
+  vector<vector<string>> removed;
+  {
+    MutexLock writing(&shard->writeLock);
+    Transaction transaction(fileSystem->disk);
+    removeEntry(fileSystem, parent, path, recursive, removed);
+    transaction.commit();
+  }
+
+  // backups replay a recursive delete one entry at a time, children first
+  uint64_t lsn = 0;
+  for (size_t idx = 0; idx < removed.size(); idx++) {
+    invalidate(removed[idx], removed[idx].size() - 1);
+    if (replicator != NULL) {
+      lsn = replicator->logged(HTTP_DELETE, joinPath(removed[idx]), "");
+    }
+  }
+  return lsn;
+}
+
+// The path components of a Destination header, which is either a path or
+// a full URL, and has to be under /ds3/.
+static vector<string> destinationPath(string_view destination) {
+  size_t scheme = destination.find("://");
+  if (scheme != string_view::npos) {
+    size_t path = destination.find('/', scheme + 3);
+    destination = path == string_view::npos ? string_view() : destination.substr(path);
+  }
+  vector<string> components = StringUtils::split(string(destination), '/');
+  if (components.empty() || components[0] != "ds3") {
+    throw ClientError::badRequest();
+  }
+  components.erase(components.begin());
+  for (size_t idx = 0; idx < components.size(); idx++) {
+    if (!validName(components[idx])) {
+      throw ClientError::badRequest();
+    }
+  }
+  return components;
+}
+
+void DistributedFileSystemService::transferPaths(HTTPRequest *request, vector<string> &source,
+                                                 vector<string> &destination, bool &overwrite)
+{
+  if (readOnly) {
+    throw ClientError::forbidden();
+  }
+  source = objectPath(request);
+  if (!request->hasHeader("Destination")) {
+    throw ClientError::badRequest();
+  }
+  destination = destinationPath(request->getHeader("Destination"));
+  if (source.empty() || destination.empty()) {
+    // the root can't be moved, copied or replaced
+    throw ClientError::badRequest();
+  }
+  overwrite = !request->hasHeader("Overwrite") || request->getHeader("Overwrite") != "F";
+}
+
+void DistributedFileSystemService::move(HTTPRequest *request, HTTPResponse *response)
+{
+  vector<string> source, destination;
+  bool overwrite;
+  transferPaths(request, source, destination, overwrite);
+
+  uint64_t lsn = moveObject(source, destination, overwrite);
+  if (replicator != NULL) {
+    replicator->waitForBackups(lsn);
+  }
   response->setBody("");
 }
+
+uint64_t DistributedFileSystemService::moveObject(const vector<string> &source, const vector<string> &destination,
+                                                  bool overwrite)
+{
+  // a rename only rewrites directory entries, which can't point across
+  // disk images
+  if (shardIndex(source[0]) != shardIndex(destination[0])) {
+    throw ClientError::conflict();
+  }
+  Shard *shard = shardFor(source[0]);
+  LocalFileSystem *fileSystem = shard->fileSystem;
+
+  // both parents get their entries rewritten, and the lock on the source's
+  // parent covers everything being moved
+  vector<PathLockTable::Lock> locks;
+  PathLockTable::plan(source, source.size() - 1, PathLockTable::X, locks);
+  PathLockTable::plan(destination, destination.size() - 1, PathLockTable::X, locks);
+  PathLockGuard held(&shard->pathLocks, locks);
+
+  int sourceParent = resolve(fileSystem, source, source.size() - 1);
+  if (existingDepth(fileSystem, destination) < destination.size() - 1) {
+    // like WebDAV, the destination's parent has to exist already
+    throw ClientError::conflict();
+  }
+  int destinationParent = resolve(fileSystem, destination, destination.size() - 1);
+  if (!overwrite && fileSystem->lookup(destinationParent, destination.back()) >= 0) {
+    throw ClientError::preconditionFailed();
+  }
+
+  {
+    MutexLock writing(&shard->writeLock);
+    Transaction transaction(fileSystem->disk);
+    int ret = fileSystem->rename(sourceParent, source.back(), destinationParent, destination.back());
+    if (ret == -ENOTFOUND) {
+      throw ClientError::notFound();
+    } else if (ret == -EINVALIDTYPE || ret == -EDIRNOTEMPTY || ret == -EINVALIDMOVE) {
+      throw ClientError::conflict();
+    } else if (ret == -ENOTENOUGHSPACE) {
+      throw ClientError::insufficientStorage();
+    } else if (ret < 0) {
+      throw ClientError::badRequest();
+    }
+    transaction.commit();
+  }
+
+  // everything cached under either path has moved or been replaced
+  invalidate(source, source.size() - 1);
+  invalidate(destination, destination.size() - 1);
+  cache.invalidateTree(joinPath(source));
+  cache.invalidateTree(joinPath(destination));
+  if (replicator != NULL) {
+    return replicator->logged(HTTP_MOVE, joinPath(source), joinPath(destination));
+  }
+  return 0;
+}
+
+void DistributedFileSystemService::copy(HTTPRequest *request, HTTPResponse *response)
+{
+  vector<string> source, destination;
+  bool overwrite;
+  transferPaths(request, source, destination, overwrite);
+
+  uint64_t lsn = copyObject(source, destination, overwrite);
+  if (replicator != NULL) {
+    replicator->waitForBackups(lsn);
+  }
+  response->setBody("");
+}
+
+void DistributedFileSystemService::copyEntry(Shard *shard, int inodeNumber, int parent, const string &name)
+{
+  LocalFileSystem *fileSystem = shard->fileSystem;
+  inode_t inode;
+  if (fileSystem->stat(inodeNumber, &inode) != 0) {
+    throw ClientError::notFound();
+  }
+  int ret;
+  if (inode.type == UFS_DIRECTORY) {
+    ret = fileSystem->create(parent, UFS_DIRECTORY, name);
+  } else {
+    ret = fileSystem->copy(inodeNumber, parent, name);
+  }
+  if (ret == -EINVALIDTYPE) {
+    // the destination, or something under it, is the other type
+    throw ClientError::conflict();
+  } else if (ret == -ENOTENOUGHSPACE) {
+    throw ClientError::insufficientStorage();
+  } else if (ret < 0) {
+    throw ClientError::badRequest();
+  }
+
+  if (inode.type == UFS_DIRECTORY) {
+    vector<dir_ent_t> entries = readEntries(fileSystem, inodeNumber, inode);
+    for (size_t idx = 0; idx < entries.size(); idx++) {
+      copyEntry(shard, entries[idx].inum, ret, entryName(entries[idx]));
+    }
+  } else {
+    // copy returns 0, and may have replaced an existing file in place
+    touchFile(shard, fileSystem->lookup(parent, name));
+  }
+}
+
+void DistributedFileSystemService::touchFile(Shard *shard, int inodeNumber)
+{
+  if (inodeNumber >= 0 && inodeNumber < shard->numInodes) {
+    shard->generations[inodeNumber].store(nextGeneration.fetch_add(1) + 1);
+  }
+}
+
+string DistributedFileSystemService::fileEtag(Shard *shard, int inodeNumber)
+{
+  uint64_t generation = 0;
+  if (inodeNumber >= 0 && inodeNumber < shard->numInodes) {
+    generation = shard->generations[inodeNumber].load();
+  }
+  char etag[64];
+  snprintf(etag, sizeof(etag), "\"%x-%lx\"", inodeNumber, (unsigned long) generation);
+  return etag;
+}
+
+uint64_t DistributedFileSystemService::copyObject(const vector<string> &source, const vector<string> &destination,
+                                                  bool overwrite)
+{
+  size_t common = min(source.size(), destination.size());
+  if (equal(source.begin(), source.begin() + common, destination.begin())) {
+    // a directory can't be copied into itself, and replacing one of the
+    // source's parents would delete the source
+    throw ClientError::conflict();
+  }
+
+  if (shardIndex(source[0]) != shardIndex(destination[0])) {
+    // blocks can't be shared across disk images, so files are read and
+    // written like a GET and PUT would
+    shared_ptr<const ObjectCache::Entry> object = lookupObject(source);
+    if (object->directory) {
+      throw ClientError::conflict();
+    }
+    if (!overwrite) {
+      try {
+        lookupObject(destination);
+        throw ClientError::preconditionFailed();
+      } catch (ClientError &ce) {
+        if (ce.status_code != 404) {
+          throw;
+        }
+      }
+    }
+    return putObject(destination, object->body);
+  }
+
+  Shard *shard = shardFor(source[0]);
+  LocalFileSystem *fileSystem = shard->fileSystem;
+  vector<PathLockTable::Lock> locks;
+  PathLockTable::plan(source, source.size(), PathLockTable::S, locks);
+  PathLockTable::plan(destination, destination.size() - 1, PathLockTable::X, locks);
+  PathLockGuard held(&shard->pathLocks, locks);
+
+  int sourceInode = resolve(fileSystem, source, source.size());
+  if (existingDepth(fileSystem, destination) < destination.size() - 1) {
+    throw ClientError::conflict();
+  }
+  int destinationParent = resolve(fileSystem, destination, destination.size() - 1);
+  int existing = fileSystem->lookup(destinationParent, destination.back());
+  if (!overwrite && existing >= 0) {
+    throw ClientError::preconditionFailed();
+  }
+  inode_t sourceType, existingType;
+  bool replaceDirectory = existing >= 0 && fileSystem->stat(sourceInode, &sourceType) == 0 &&
+    fileSystem->stat(existing, &existingType) == 0 &&
+    sourceType.type == UFS_DIRECTORY && existingType.type == UFS_DIRECTORY;
+
+  {
+    MutexLock writing(&shard->writeLock);
+    Transaction transaction(fileSystem->disk);
+    if (replaceDirectory) {
+      // a directory copied over another replaces it rather than merging
+      // into it, so nothing that was only in the old one survives
+      vector<vector<string>> removed;
+      removeEntry(fileSystem, destinationParent, destination, true, removed);
+    }
+    copyEntry(shard, sourceInode, destinationParent, destination.back());
+    transaction.commit();
+  }
+
+  invalidate(destination, destination.size() - 1);
+  cache.invalidateTree(joinPath(destination));
+  if (replicator != NULL) {
+    return replicator->logged(HTTP_COPY, joinPath(source), joinPath(destination));
+  }
+  return 0;
+}
+
+// letters, digits, '-', '_' and '.', but not starting with a '.'
+static bool validSnapshotName(const string &name) {
+  if (name.empty() || name.size() > 64 || name[0] == '.') {
+    return false;
+  }
+  for (size_t idx = 0; idx < name.size(); idx++) {
+    if (!isalnum((unsigned char) name[idx]) && name[idx] != '-' && name[idx] != '_' && name[idx] != '.') {
+      return false;
+    }
+  }
+  return true;
+}
+
+void DistributedFileSystemService::createSnapshot(const string &name)
+{
+  if (!validSnapshotName(name)) {
+    throw ClientError::badRequest();
+  }
+  // Every shard's write lock, in shard order like a batch, so no
+  // transaction is part way through on any of them and the snapshot is
+  // the same point in time on all of them.
+  vector<unique_ptr<MutexLock>> writing;
+  for (size_t idx = 0; idx < shards.size(); idx++) {
+    writing.push_back(make_unique<MutexLock>(&shards[idx]->writeLock));
+  }
+  for (size_t idx = 0; idx < shards.size(); idx++) {
+    vector<string> names = shards[idx]->fileSystem->disk->snapshots();
+    if (find(names.begin(), names.end(), name) != names.end()) {
+      throw ClientError::conflict();
+    }
+  }
+  for (size_t idx = 0; idx < shards.size(); idx++) {
+    shards[idx]->fileSystem->disk->createSnapshot(name);
+  }
+}
+
+void DistributedFileSystemService::deleteSnapshot(const string &name)
+{
+  bool deleted = false;
+  for (size_t idx = 0; idx < shards.size(); idx++) {
+    deleted = shards[idx]->fileSystem->disk->deleteSnapshot(name) || deleted;
+  }
+  if (!deleted) {
+    throw ClientError::notFound();
+  }
+}
+
+string DistributedFileSystemService::listSnapshots()
+{
+  // every shard has the same ones
+  vector<string> names = shards[0]->fileSystem->disk->snapshots();
+  string listing;
+  for (size_t idx = 0; idx < names.size(); idx++) {
+    listing += names[idx];
+    listing += "\n";
+  }
+  return listing;
+}
@@ -2,16 +2,21 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 
 #include <iostream>
 #include <map>
 #include <string>
+#include <vector>
 
 #include "FileService.h"
 #include "ClientError.h"
 
 using namespace std;
 
+// files bigger than this are streamed instead of buffered
+#define STREAMING_THRESHOLD (64 * 1024)
+
 FileService::FileService(string basedir) : HttpService("/") {
   while (endswith(basedir, "/")) {
     basedir = basedir.substr(0, basedir.length() - 1);
@@ -31,20 +36,94 @@ bool FileService::endswith(string str, string suffix) {
 }
 
 void FileService::get(HTTPRequest *request, HTTPResponse *response) {
+  serve(request, response, true);
+}
+
+// HEAD answers with the headers GET would send, Content-Length included,
+// from a stat of the file without reading any of it
+void FileService::head(HTTPRequest *request, HTTPResponse *response) {
+  serve(request, response, false);
+}
+
+void FileService::serve(HTTPRequest *request, HTTPResponse *response, bool withBody) {
   string path = this->m_basedir + request->getPath();
+
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    throw ClientError::notFound();
+  }
+
+  // same validator Apache uses: inode-size-mtime
+  char etag[96];
+  snprintf(etag, sizeof(etag), "\"%lx-%lx-%lx\"",
+           (unsigned long) st.st_ino, (unsigned long) st.st_size,
+           (unsigned long) st.st_mtime);
+  if (this->notModified(request, response, etag, st.st_mtime)) {
+    return;
+  }
+
+  if (this->endswith(path, ".css")) {
+    response->setContentType("text/css");
+  } else if (this->endswith(path, ".js")) {
+    response->setContentType("text/javascript");
+  }
+
+  vector<ByteRange> ranges;
+  if (this->rangeRequested(request, response, st.st_size, etag, ranges)) {
+    vector<string> parts;
+    if (withBody && !this->readRanges(path, ranges, parts)) {
+      throw ClientError::notFound();
+    }
+    response->setPartialBody(ranges, parts, st.st_size);
+    return;
+  }
+
+  if (!withBody) {
+    response->setContentLength(st.st_size);
+    return;
+  }
+
+  if (st.st_size > STREAMING_THRESHOLD) {
+    this->streamFile(path, response);
+    return;
+  }
+
   string fileContents = this->readFile(path);
   if (fileContents.size() == 0) {
     throw ClientError::notFound();
   } else {
-    if (this->endswith(path, ".css")) {
-      response->setContentType("text/css");
-    } else if (this->endswith(path, ".js")) {
-      response->setContentType("text/javascript");
-    }
     response->setBody(fileContents);
   }
 }
 
+// Sends a large file as a chunked response so we only ever hold one
+// buffer of it in memory
+void FileService::streamFile(string path, HTTPResponse *response) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw ClientError::notFound();
+  }
+
+  char *buffer = new char[STREAMING_THRESHOLD];
+  int ret;
+  try {
+    while ((ret = read(fd, buffer, STREAMING_THRESHOLD)) > 0) {
+      response->writeChunk(buffer, ret);
+    }
+  } catch (...) {
+    delete [] buffer;
+    close(fd);
+    throw;
+  }
+
+  delete [] buffer;
+  close(fd);
+  if (ret < 0) {
+    // we've already committed to a 200, this marks the stream broken
+    response->setStatus(500);
+  }
+}
+
 string FileService::readFile(string path) {
   int fd = open(path.c_str(), O_RDONLY);
   if (fd < 0) {
@@ -63,8 +142,26 @@ string FileService::readFile(string path) {
   return result;
 }
 
-void FileService::head(HTTPRequest *request, HTTPResponse *response) {
-  // HEAD is the same as get but with no body
-  this->get(request, response);
-  response->setBody("");
+bool FileService::readRanges(string path, vector<ByteRange> ranges, vector<string> &parts) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  for (unsigned int idx = 0; idx < ranges.size(); idx++) {
+    string part(ranges[idx].last - ranges[idx].first + 1, '\0');
+    size_t done = 0;
+    while (done < part.size()) {
+      ssize_t ret = pread(fd, &part[done], part.size() - done, ranges[idx].first + done);
+      if (ret <= 0) {
+        close(fd);
+        return false;
+      }
+      done += ret;
+    }
+    parts.push_back(part);
+  }
+
+  close(fd);
+  return true;
 }
@@ -4,7 +4,9 @@
 #include <string>
 
 #include <assert.h>
+#include <ctype.h>
 #include <stdio.h>
+#include <strings.h>
 
 using namespace std;
 
@@ -37,13 +39,12 @@ int HTTP::url_cb(http_parser *parser, const char *at, size_t length)
     HTTP *http = (HTTP *) parser->data;
     http->appendUrl(at, length);
 
-    return 0;
+    return http->headersTooLarge() ? -1 : 0;
 }
 
+// fragments are for the client, servers just ignore them
 int HTTP::fragment_cb(http_parser */*parser*/, const char */*at*/, size_t /*length*/)
 {
-    cout << "fragment" << endl;
-    assert(false);
     return 0;
 }
 
@@ -61,7 +62,7 @@ int HTTP::header_field_cb(http_parser *parser, const char *at, size_t length)
         assert(false);
     }
 
-    return 0;
+    return http->headersTooLarge() ? -1 : 0;
 }
 
 int HTTP::header_value_cb(http_parser *parser, const char *at, size_t length)
@@ -72,14 +73,20 @@ int HTTP::header_value_cb(http_parser *parser, const char *at, size_t length)
     }
     assert(http->getState() == HTTP::VALUE);
     http->appendHeaderValue(at, length);
-    return 0;
+    return http->headersTooLarge() ? -1 : 0;
 }
 
 int HTTP::headers_complete_cb(http_parser *parser)
 {
     HTTP *http = (HTTP *) parser->data;
-    http->addHeaderField();
+    http->indexHeaders();
     http->m_headerDone = true;
+    // -1 when there is no Content-Length, e.g., chunked uploads
+    http->m_contentLength = parser->content_length;
+    // the method is known now, services run before the body is read
+    if(http->m_httpType == HTTP_REQUEST) {
+        http->m_method = parser->method;
+    }
 
     if(http->m_httpType == HTTP_RESPONSE) {
         char buf[64];
@@ -119,15 +126,28 @@ int HTTP::headers_complete_cb(http_parser *parser)
 int HTTP::body_cb(http_parser *parser, const char *at, size_t length)
 {
     HTTP *http = (HTTP *) parser->data;
-    http->m_body.append(at, length);
+    http->m_bodyBytesParsed += length;
+    if(http->m_bodySink == NULL) {
+        http->m_body.append(at, length);
+        return 0;
+    }
 
+    // don't let C++ exceptions unwind through the C parser
+    try {
+        http->m_bodySink->onBodyData(at, length);
+    } catch(...) {
+        http->m_bodySinkError = current_exception();
+        return -1;
+    }
     return 0;
 }
 
 int HTTP::message_complete_cb(http_parser *parser)
 {
     HTTP *http = (HTTP *) parser->data;
-    assert((http->getState() == HTTP::VALUE) || 
+    // HEADER when the request had no header lines at all
+    assert((http->getState() == HTTP::HEADER) ||
+           (http->getState() == HTTP::VALUE) || 
            (http->getState() == HTTP::BODY));
     http->setState(HTTP::DONE);
     http->messageComplete(parser->method);
@@ -141,7 +161,9 @@ int HTTP::message_complete_cb(http_parser *parser)
 /*************************** Public Functions *******************************/
 
 
-HTTP::HTTP(http_parser_type httpType)
+HTTP::HTTP(http_parser_type httpType, pmr::memory_resource *resource)
+    : m_url(resource), m_path(resource), m_query(resource), m_host(resource),
+      m_headerBuffer(resource), m_headers(resource)
 {
     m_state = INIT;
     http_parser_init(&m_parser, httpType);
@@ -162,25 +184,34 @@ HTTP::HTTP(http_parser_type httpType)
 
     m_parser.data = this;
 
-    m_field = NULL;
-    m_value = NULL;
     m_extraParsedBytes = 0;
+    m_headerBuffer.reserve(1024);
+    m_bodySink = NULL;
+    m_contentLength = -1;
+    m_bodyBytesParsed = 0;
+    m_error = PARSE_OK;
+    m_maxHeaderBytes = 0;
+    m_maxHeaders = 0;
 }
 
-HTTP::~HTTP()
+void HTTP::setHeaderLimits(size_t maxBytes, size_t maxCount)
 {
-    if(m_field != NULL) {
-        delete m_field;
-    }
+    m_maxHeaderBytes = maxBytes;
+    m_maxHeaders = maxCount;
+}
 
-    if(m_value != NULL) {
-        delete m_value;
+bool HTTP::headersTooLarge()
+{
+    if(((m_maxHeaderBytes > 0) && (m_url.size() + m_headerBuffer.size() > m_maxHeaderBytes)) ||
+       ((m_maxHeaders > 0) && (m_headers.size() > m_maxHeaders))) {
+        m_error = PARSE_HEADERS_TOO_LARGE;
+        return true;
     }
+    return false;
+}
 
-    for(unsigned int idx = 0; idx < m_headers.size(); idx++) {
-        delete m_headers[idx].first;
-        delete m_headers[idx].second;
-    }
+HTTP::~HTTP()
+{
 }
 
 int HTTP::addData(const unsigned char *data, int len)
@@ -189,29 +220,51 @@ int HTTP::addData(const unsigned char *data, int len)
         assert(false);
     }
     int ret = http_parser_execute(&m_parser, &m_settings, (const char *) data, len);
+    if(m_bodySinkError) {
+        exception_ptr error = m_bodySinkError;
+        m_bodySinkError = NULL;
+        rethrow_exception(error);
+    }
+    // responses stop early on purpose after their headers, see
+    // headers_complete_cb, anything else short of len is bad input
+    if((m_httpType == HTTP_REQUEST) && (ret < len) && !m_doneParsing &&
+       (m_error == PARSE_OK)) {
+        m_error = PARSE_INVALID;
+    }
     ret += m_extraParsedBytes;
     m_extraParsedBytes = 0;
     return ret;
 }
 
-string HTTP::getBody()
+const string &HTTP::getBody()
 {
     return m_body;
 }
 
+void HTTP::setBodySink(BodySink *sink)
+{
+    // hand over anything that arrived along with the headers
+    if((sink != NULL) && (m_body.size() > 0)) {
+        string buffered;
+        buffered.swap(m_body);
+        sink->onBodyData(buffered.c_str(), buffered.size());
+    }
+    m_bodySink = sink;
+}
+
 string HTTP::getUrl()
 {
-    return m_url;
+    return string(m_url);
 }
 
 string HTTP::getPath()
 {
-    return m_path;
+    return string(m_path);
 }
 
 string HTTP::getHost()
 {
-    string host = (m_method == HTTP_CONNECT) ? m_url : m_host;
+    string host((m_method == HTTP_CONNECT) ? m_url : m_host);
     if(host.find(':') == string::npos) {
         host += ":80";
     }
@@ -239,8 +292,8 @@ string HTTP::getReplyHeader()
 
     bool foundConn = false;
     for(unsigned int idx = 0; idx < m_headers.size(); idx++) {
-        string field = *(m_headers[idx].first);
-        string value = *(m_headers[idx].second);
+        string field(headerField(idx));
+        string value(headerValue(idx));
 
         if(field == "Connection") {
             value = "close";
@@ -298,8 +351,8 @@ string HTTP::getProxyRequest(const char *userAgent)
     }
 
     for(unsigned int idx = 0; idx < m_headers.size(); idx++) {
-        string field = *(m_headers[idx].first);
-        string value = *(m_headers[idx].second);
+        string field(headerField(idx));
+        string value(headerValue(idx));
 
         if((userAgent != NULL) && (field == "User-Agent")) {
             value = string(userAgent);
@@ -350,45 +403,88 @@ void HTTP::appendUrl(const char *at, size_t len)
     m_url.append(at, len);
 }
 
-void HTTP::addHeaderField()
+// FNV-1a over the lower cased field name
+uint32_t HTTP::hashHeaderField(string_view field)
 {
-    if(m_field != NULL) {
-        assert(m_value != NULL);
-        if(*m_field == "Host") {
-            m_host = *m_value;
+    uint32_t hash = 2166136261u;
+    for(size_t idx = 0; idx < field.size(); idx++) {
+        hash ^= (unsigned char) tolower(field[idx]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void HTTP::indexHeaders()
+{
+    for(unsigned int idx = 0; idx < m_headers.size(); idx++) {
+        m_headers[idx].hash = hashHeaderField(headerField(idx));
+    }
+
+    string_view host;
+    if(findHeader("Host", host)) {
+        m_host = host;
+    }
+}
+
+bool HTTP::findHeader(string_view field, string_view &value)
+{
+    uint32_t hash = hashHeaderField(field);
+    for(unsigned int idx = 0; idx < m_headers.size(); idx++) {
+        if(m_headers[idx].hash != hash || m_headers[idx].fieldLength != field.size()) {
+            continue;
         }
-        if(*m_field == "Eoh") {
-            cout << "got the Eoh header" << endl;
+        if(strncasecmp(m_headerBuffer.data() + m_headers[idx].fieldOffset, field.data(), field.size()) == 0) {
+            value = headerValue(idx);
+            return true;
         }
-        m_headers.insert(m_headers.end(), pair<string *, string *>(m_field, m_value));
-        m_field = NULL;
-        m_value = NULL;
-    } else {
-        assert(m_value == NULL);
     }
+    return false;
+}
+
+string_view HTTP::headerField(size_t idx)
+{
+    return string_view(m_headerBuffer.data() + m_headers[idx].fieldOffset, m_headers[idx].fieldLength);
+}
+
+string_view HTTP::headerValue(size_t idx)
+{
+    return string_view(m_headerBuffer.data() + m_headers[idx].valueOffset, m_headers[idx].valueLength);
 }
 
 void HTTP::newHeaderField(const char *at, size_t len)
 {
-    addHeaderField();
-    m_field = new string(at, len);
-    m_value = new string();
+    HeaderSpan span;
+    span.fieldOffset = m_headerBuffer.size();
+    span.fieldLength = len;
+    span.valueOffset = 0;
+    span.valueLength = 0;
+    span.hash = 0;
+    m_headerBuffer.append(at, len);
+    m_headers.push_back(span);
 }
+
 void HTTP::appendHeaderField(const char *at, size_t len)
 {
-    assert(m_field != NULL);
-    m_field->append(at, len);
+    assert(m_headers.size() > 0);
+    m_headerBuffer.append(at, len);
+    m_headers.back().fieldLength += len;
 }
 
 void HTTP::appendHeaderValue(const char *at, size_t len)
 {
-    m_value->append(at, len);
+    assert(m_headers.size() > 0);
+    HeaderSpan &span = m_headers.back();
+    if(span.valueLength == 0) {
+        span.valueOffset = m_headerBuffer.size();
+    }
+    m_headerBuffer.append(at, len);
+    span.valueLength += len;
 }
 
 void HTTP::messageComplete(unsigned char method)
 {
     if(m_httpType == HTTP_REQUEST) {
-      assert((method == HTTP_GET) || (method == HTTP_CONNECT) || (method == HTTP_POST) || (method == HTTP_HEAD) || (method == HTTP_PUT) || (method == HTTP_DELETE) || (method == HTTP_MOVE));
+        // methods we don't serve get a 501 from the router
         m_method = method;
     }
     m_doneParsing = true;
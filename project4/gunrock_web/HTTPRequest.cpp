@@ -1,30 +1,86 @@
 #include "HTTPRequest.h"
 
+#include <algorithm>
 #include <iostream>
 #include <string>
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
 
 #include "HttpUtils.h"
+#include "RequestArena.h"
 #include "StringUtils.h"
 
 using namespace std;
 
 #define CONNECT_REPLY "HTTP/1.1 200 Connection Established\r\n\r\n"
 
-HTTPRequest::HTTPRequest(MySocket *sock, int serverPort)
+// more ranges than this in one request is treated as a full GET
+#define MAX_BYTE_RANGES (16)
+
+// bounds for the per-connection read buffer, the upper one fits the
+// largest ds3 file plus its headers in a single read
+#define MIN_READ_BUFFER (4 * 1024)
+#define MAX_READ_BUFFER (128 * 1024)
+
+// running average of request sizes seen by this thread, used to size the
+// next connection's read buffer so typical requests need one recv
+static thread_local size_t observedRequestSize = MIN_READ_BUFFER;
+
+RequestLimits HTTPRequest::limits;
+
+// A byte position from a Range header: decimal digits only, no sign or
+// spaces, and small enough for a long. False on anything else.
+static bool parseBytePos(const string &str, long &value)
+{
+    if (str.empty() || str[0] < '0' || str[0] > '9') {
+        return false;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long parsed = strtoull(str.c_str(), &end, 10);
+    if (errno != 0 || *end != '\0' || parsed > (unsigned long long) LONG_MAX) {
+        return false;
+    }
+    value = (long) parsed;
+    return true;
+}
+
+static uint64_t monotonicMillis()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+HTTPRequest::HTTPRequest(MySocket *sock, int serverPort, pmr::memory_resource *resource)
 {
     m_sock = sock;
-    m_http = new HTTP();
+    m_resource = resource;
+    m_http = resourceNew<HTTP>(resource, HTTP_REQUEST, resource);
     m_serverPort = serverPort;
     m_totalBytesRead = 0;
     m_totalBytesWritten = 0;
+    m_readBuffer = NULL;
+    m_readBufferSize = 0;
+    m_firstByteAt = 0;
+    m_bodyStartedAt = 0;
+    m_readFailed = false;
+    m_http->setHeaderLimits(limits.maxHeaderBytes, limits.maxHeaders);
+    growReadBuffer(observedRequestSize);
 }
 
 HTTPRequest::~HTTPRequest()
 {
-    delete m_http;
+    if(m_totalBytesRead > 0) {
+        observedRequestSize = (observedRequestSize * 7 + m_totalBytesRead) / 8;
+    }
+    m_resource->deallocate(m_readBuffer, m_readBufferSize);
+    resourceDelete(m_resource, m_http);
 }
 
 void HTTPRequest::printDebugInfo()
@@ -40,27 +96,130 @@ map<string, string> HTTPRequest::getParams() {
 }
 
 WwwFormEncodedDict HTTPRequest::formEncodedBody() {
-  WwwFormEncodedDict dict(m_http->getBody());
+  WwwFormEncodedDict dict(getBody());
   return dict;
 }
 
+const string &HTTPRequest::getBody() {
+  // services that don't stream get the whole body buffered for them
+  readUntilDone();
+  return m_http->getBody();
+}
+
 string HTTPRequest::getPath() {
   return m_http->getPath();
 }
 
-string HTTPRequest::getHeader(string key) {
-  vector<pair<string *, string *> >::iterator iter;
-  vector<pair<string *, string *> > headers = m_http->getHeaders();
-  for (iter = headers.begin(); iter != headers.end(); iter++) {
-    string header_key = *(iter->first);
-    if (header_key == key) {
-      return *(iter->second);
-    }
+string_view HTTPRequest::getHeader(string_view key) {
+  string_view value;
+  if (m_http->findHeader(key, value)) {
+    return value;
   }
 
   throw "could not find header";
 }
 
+bool HTTPRequest::hasHeader(string_view key) {
+  string_view value;
+  return m_http->findHeader(key, value);
+}
+
+// Parses a "Range: bytes=..." header against a representation that is
+// size bytes long. Returns false if there is no Range header or it is
+// malformed, in which case the caller should send the whole thing. On
+// true, ranges holds the satisfiable ranges, which may be empty (416).
+// Overlapping and adjacent ranges are coalesced (RFC 7233 4.1), so the
+// parts never add up to more than the representation.
+bool HTTPRequest::getByteRanges(long size, vector<ByteRange> &ranges) {
+  ranges.clear();
+  if (!hasHeader("Range")) {
+    return false;
+  }
+
+  string header(getHeader("Range"));
+  if (header.find("bytes=") != 0) {
+    return false;
+  }
+
+  vector<string> specs = StringUtils::split(header.substr(6), ',');
+  if (specs.size() == 0 || specs.size() > MAX_BYTE_RANGES) {
+    return false;
+  }
+
+  for (unsigned int idx = 0; idx < specs.size(); idx++) {
+    string spec = specs[idx];
+    size_t start = spec.find_first_not_of(" \t");
+    if (start == string::npos) {
+      return false;
+    }
+    spec = spec.substr(start, spec.find_last_not_of(" \t") - start + 1);
+
+    size_t dash = spec.find('-');
+    if (dash == string::npos ||
+        spec.find_first_not_of("0123456789-") != string::npos ||
+        spec.find('-', dash + 1) != string::npos) {
+      return false;
+    }
+    string firstStr = spec.substr(0, dash);
+    string lastStr = spec.substr(dash + 1);
+
+    ByteRange range;
+    if (firstStr.size() == 0) {
+      // suffix range, the last N bytes
+      if (lastStr.size() == 0) {
+        return false;
+      }
+      long suffix;
+      if (!parseBytePos(lastStr, suffix)) {
+        return false;
+      }
+      if (suffix == 0 || size == 0) {
+        continue;
+      }
+      range.first = suffix >= size ? 0 : size - suffix;
+      range.last = size - 1;
+    } else {
+      if (!parseBytePos(firstStr, range.first)) {
+        return false;
+      }
+      if (lastStr.size() == 0) {
+        range.last = size - 1;
+      } else {
+        if (!parseBytePos(lastStr, range.last)) {
+          return false;
+        }
+        if (range.last < range.first) {
+          return false;
+        }
+      }
+      if (range.first >= size) {
+        continue;
+      }
+      if (range.last >= size) {
+        range.last = size - 1;
+      }
+    }
+    ranges.push_back(range);
+  }
+
+  sort(ranges.begin(), ranges.end(), [](const ByteRange &a, const ByteRange &b) {
+    return a.first < b.first;
+  });
+  size_t merged = 0;
+  for (size_t idx = 1; idx < ranges.size(); idx++) {
+    if (ranges[idx].first <= ranges[merged].last + 1) {
+      ranges[merged].last = max(ranges[merged].last, ranges[idx].last);
+    } else {
+      ranges[++merged] = ranges[idx];
+    }
+  }
+  if (!ranges.empty()) {
+    ranges.resize(merged + 1);
+  }
+
+  return true;
+}
+
 bool HTTPRequest::hasAuthToken() {
   try {
     getHeader("x-auth-token");
@@ -72,7 +231,7 @@ bool HTTPRequest::hasAuthToken() {
 
 string HTTPRequest::getAuthToken() {
   try {
-    return getHeader("x-auth-token");
+    return string(getHeader("x-auth-token"));
   } catch (...) {
     return "";
   }
@@ -82,19 +241,154 @@ vector<string> HTTPRequest::getPathComponents() {
   return StringUtils::split(getPath(), '/');
 }
 
+pmr::vector<string_view> HTTPRequest::getPathViews() {
+  return StringUtils::splitViews(m_http->getPathView(), '/', m_resource);
+}
+
 bool HTTPRequest::readRequest()
 {
     assert(!m_http->isDone());
 
-    string readData;
-    while(!m_http->isDone()) {
-        readData = m_sock->read();
-	onRead(readData.c_str(), readData.size());
+    while(!m_http->isHeaderDone()) {
+        readOnce();
     }
 
     return true;
 }
 
+void HTTPRequest::readBody(BodySink *sink)
+{
+    m_http->setBodySink(sink);
+    readUntilDone();
+    m_http->setBodySink(NULL);
+}
+
+class DiscardBodySink : public BodySink {
+ public:
+    virtual void onBodyData(const char *data, size_t length) {}
+};
+
+// Reads whatever body the service didn't consume so closing the socket
+// doesn't reset the connection before the client sees our response.
+void HTTPRequest::discardBody()
+{
+    if(m_http->isDone() || m_readFailed) {
+        return;
+    }
+    DiscardBodySink sink;
+    readBody(&sink);
+}
+
+void HTTPRequest::readUntilDone()
+{
+    // once the length is known the whole body can go in one buffer
+    long remaining = m_http->getContentLength() - m_http->getBodyBytesParsed();
+    if(remaining > (long) m_readBufferSize) {
+        growReadBuffer(remaining);
+    }
+    while(!m_http->isDone()) {
+        readOnce();
+    }
+}
+
+void HTTPRequest::readOnce()
+{
+    if(m_readFailed) {
+        throw SocketReadError();
+    }
+
+    try {
+        int flags = 0;
+        size_t len = m_readBufferSize;
+        long remaining = m_http->getContentLength() - m_http->getBodyBytesParsed();
+        if(m_http->isHeaderDone() && remaining > 0) {
+            // the body size is known, so wait for a full buffer rather than
+            // waking up for every segment
+            flags = MSG_WAITALL;
+            len = min(len, (size_t) remaining);
+        }
+
+        // the headers get one deadline in total, so trickling them in a
+        // byte at a time doesn't reset the clock
+        uint64_t now = monotonicMillis();
+        int timeout;
+        if(m_totalBytesRead == 0) {
+            timeout = limits.idleTimeout;
+        } else if(!m_http->isHeaderDone()) {
+            timeout = 0;
+            if(limits.headerTimeout > 0) {
+                long left = (long) (m_firstByteAt + limits.headerTimeout) - (long) now;
+                if(left <= 0) {
+                    throw ClientError::requestTimeout();
+                }
+                timeout = left;
+            }
+        } else {
+            if(m_bodyStartedAt == 0) {
+                m_bodyStartedAt = now;
+            }
+            timeout = limits.bodyTimeout;
+        }
+        m_sock->setReceiveTimeout(timeout);
+
+        int ret;
+        try {
+            ret = m_sock->recv(m_readBuffer, len, flags);
+        } catch(SocketTimeout &e) {
+            throw ClientError::requestTimeout();
+        }
+        if(m_firstByteAt == 0) {
+            m_firstByteAt = monotonicMillis();
+        }
+        onRead(m_readBuffer, ret);
+
+        // a body arriving slower than minBodyRate is treated as a stall
+        if(m_bodyStartedAt != 0 && limits.minBodyRate > 0) {
+            long elapsed = monotonicMillis() - m_bodyStartedAt;
+            if(elapsed > limits.minRateGrace &&
+               m_http->getBodyBytesParsed() * 1000 < limits.minBodyRate * elapsed) {
+                throw ClientError::requestTimeout();
+            }
+        }
+    } catch(...) {
+        m_readFailed = true;
+        throw;
+    }
+}
+
+void HTTPRequest::growReadBuffer(size_t size)
+{
+    size = max(size, (size_t) MIN_READ_BUFFER);
+    size = min(size, (size_t) MAX_READ_BUFFER);
+    if(size <= m_readBufferSize) {
+        return;
+    }
+    if(m_readBuffer != NULL) {
+        m_resource->deallocate(m_readBuffer, m_readBufferSize);
+    }
+    m_readBuffer = (char *) m_resource->allocate(size);
+    m_readBufferSize = size;
+}
+
+BufferedBodySink::BufferedBodySink(size_t maxSize, long contentLength)
+{
+    m_maxSize = maxSize;
+    if(contentLength > (long) maxSize) {
+        throw ClientError::payloadTooLarge();
+    }
+    if(contentLength > 0) {
+        m_body.reserve(contentLength);
+    }
+}
+
+void BufferedBodySink::onBodyData(const char *data, size_t length)
+{
+    if(m_body.size() + length > m_maxSize) {
+        throw ClientError::payloadTooLarge();
+    }
+    m_body.append(data, length);
+}
+
 void HTTPRequest::onRead(const char *buffer, unsigned int len)
 {
     m_totalBytesRead += len;
@@ -105,6 +399,11 @@ void HTTPRequest::onRead(const char *buffer, unsigned int len)
     while(bytesRead < len) {
         assert(!m_http->isDone());
         int ret = m_http->addData((const unsigned char *) (buffer + bytesRead), len - bytesRead);
+        if(m_http->getError() == HTTP::PARSE_HEADERS_TOO_LARGE) {
+            throw ClientError::headersTooLarge();
+        } else if(m_http->getError() != HTTP::PARSE_OK) {
+            throw ClientError::badRequest();
+        }
         assert(ret > 0);
         bytesRead += ret;
         
@@ -1,13 +1,27 @@
 #include <sstream>
 
+#include <stdio.h>
+#include <string.h>
+
 #include "HTTPResponse.h"
 
 using namespace std;
 
-HTTPResponse::HTTPResponse() {
+#define BYTERANGES_BOUNDARY "GUNROCK_BYTERANGES_3d6b8e2a"
+
+// headers every response carries, formatted once
+static const char STATIC_HEADERS[] = "Server: Gunrock Web\r\n";
+static const char CHUNKED_HEADER[] = "Transfer-Encoding: chunked\r\n";
+
+HTTPResponse::HTTPResponse(MySocket *client, pmr::memory_resource *resource)
+  : headers(resource), head(resource) {
+  this->client = client;
   this->streaming = false;
+  this->omitBody = false;
+  this->headersSent = false;
+  this->streamBroken = false;
+  this->contentLength = -1;
   this->contentType = "text/html; charset=ISO-8859-1";
-  this->headers["Server"] = "Gunrock Web";
   this->status = 200;
 }
 
@@ -15,14 +29,134 @@ void HTTPResponse::withStreaming() {
   this->streaming = true;
 }
 
+// HEAD requests: headers are computed as usual but the body is never sent
+void HTTPResponse::withoutBody() {
+  this->omitBody = true;
+}
+
+bool HTTPResponse::isStreaming() {
+  return streaming;
+}
+
+bool HTTPResponse::isStreamBroken() {
+  return streamBroken;
+}
+
+void HTTPResponse::sendHeaders() {
+  if (client == NULL) {
+    throw SocketNotConnected();
+  }
+  headersSent = true;
+  const pmr::string &headerBytes = formatHeaders();
+  struct iovec iov = { (void *) headerBytes.data(), headerBytes.size() };
+  client->writev(&iov, 1);
+}
+
+void HTTPResponse::send() {
+  if (client == NULL) {
+    throw SocketNotConnected();
+  }
+  const pmr::string &headerBytes = formatHeaders();
+  headersSent = true;
+  // headers and body go out together without being concatenated first
+  struct iovec iov[2];
+  int iovcnt = 0;
+  iov[iovcnt].iov_base = (void *) headerBytes.data();
+  iov[iovcnt++].iov_len = headerBytes.size();
+  if (body.size() > 0 && !omitBody) {
+    iov[iovcnt].iov_base = (void *) body.data();
+    iov[iovcnt++].iov_len = body.size();
+  }
+  client->writev(iov, iovcnt);
+}
+
+void HTTPResponse::writeChunk(const void *buf, int numBytes) {
+  streaming = true;
+  if (!headersSent) {
+    sendHeaders();
+  }
+  // a zero length chunk would terminate the body early
+  if (omitBody || numBytes <= 0) {
+    return;
+  }
+  HttpUtils::writeChunk(client, buf, numBytes);
+}
+
+void HTTPResponse::writeChunk(string data) {
+  writeChunk(data.c_str(), data.size());
+}
+
+void HTTPResponse::endStream() {
+  if (streamBroken) {
+    return;
+  }
+  if (!headersSent) {
+    sendHeaders();
+  }
+  if (!omitBody) {
+    HttpUtils::writeLastChunk(client);
+  }
+}
+
 void HTTPResponse::setHeader(string name, string value) {
-  this->headers[name] = value;
+  auto iter = headers.find(string_view(name));
+  if (iter == headers.end()) {
+    headers.emplace(name, value);
+  } else {
+    iter->second = value;
+  }
 }
 
 void HTTPResponse::setBody(string data) {
   body = data;
 }
 
+void HTTPResponse::setContentLength(long length) {
+  contentLength = length;
+}
+
+// 206 Partial Content, parts[i] holds the bytes for ranges[i]. A single
+// range is sent as is, several go out as multipart/byteranges.
+void HTTPResponse::setPartialBody(vector<ByteRange> ranges, vector<string> parts, long totalSize) {
+  char contentRange[128];
+  this->status = 206;
+
+  if (ranges.size() == 1) {
+    snprintf(contentRange, sizeof(contentRange), "bytes %ld-%ld/%ld",
+             ranges[0].first, ranges[0].last, totalSize);
+    setHeader("Content-Range", contentRange);
+    if (parts.empty()) {
+      setContentLength(ranges[0].last - ranges[0].first + 1);
+    } else {
+      body = parts[0];
+    }
+    return;
+  }
+
+  stringstream out;
+  long partBytes = 0;
+  for (unsigned int idx = 0; idx < ranges.size(); idx++) {
+    snprintf(contentRange, sizeof(contentRange), "bytes %ld-%ld/%ld",
+             ranges[idx].first, ranges[idx].last, totalSize);
+    out << "\r\n--" << BYTERANGES_BOUNDARY << "\r\n";
+    out << "Content-Type: " << contentType << "\r\n";
+    out << "Content-Range: " << contentRange << "\r\n\r\n";
+    if (parts.empty()) {
+      partBytes += ranges[idx].last - ranges[idx].first + 1;
+    } else {
+      out << parts[idx];
+    }
+  }
+  out << "\r\n--" << BYTERANGES_BOUNDARY << "--\r\n";
+
+  body = out.str();
+  if (parts.empty()) {
+    setContentLength(body.size() + partBytes);
+    body = "";
+  }
+  contentType = string("multipart/byteranges; boundary=") + BYTERANGES_BOUNDARY;
+}
+
 int HTTPResponse::getStatus() {
   return status;
 }
@@ -32,37 +166,108 @@ void HTTPResponse::setContentType(string contentType) {
 }
 
 void HTTPResponse::setStatus(int status) {
+  if (headersSent) {
+    // too late to tell the client, see endStream
+    streamBroken = true;
+    return;
+  }
   this->status = status;
 }
 
-string HTTPResponse::statusToString() {
+const char *HTTPResponse::statusToString() {
   if (status == 200) {
     return "OK";
+  } else if (status == 201) {
+    return "Created";
+  } else if (status == 204) {
+    return "No Content";
+  } else if (status == 206) {
+    return "Partial Content";
+  } else if (status == 304) {
+    return "Not Modified";
+  } else if (status == 400) {
+    return "Bad Request";
+  } else if (status == 401) {
+    return "Unauthorized";
+  } else if (status == 403) {
+    return "Forbidden";
+  } else if (status == 404) {
+    return "Not Found";
+  } else if (status == 405) {
+    return "Method Not Allowed";
+  } else if (status == 408) {
+    return "Request Timeout";
+  } else if (status == 409) {
+    return "Conflict";
+  } else if (status == 412) {
+    return "Precondition Failed";
+  } else if (status == 413) {
+    return "Payload Too Large";
+  } else if (status == 416) {
+    return "Range Not Satisfiable";
+  } else if (status == 431) {
+    return "Request Header Fields Too Large";
+  } else if (status == 500) {
+    return "Internal Server Error";
+  } else if (status == 501) {
+    return "Not Implemented";
+  } else if (status == 503) {
+    return "Service Unavailable";
+  } else if (status == 507) {
+    return "Insufficient Storage";
   } else {
     return "Unknown";
   }
 }
 
-string HTTPResponse::response() {
-  stringstream out;
-  setHeader("Content-Type", contentType);
+// Formats the status line and headers into head, which lives as long as
+// the response and is reused if it is formatted again.
+const pmr::string &HTTPResponse::formatHeaders() {
+  char number[32];
+  head.clear();
+  head.reserve(256);
+
+  head.append("HTTP/1.1 ");
+  snprintf(number, sizeof(number), "%d ", status);
+  head.append(number);
+  head.append(statusToString());
+  head.append("\r\n");
+
+  head.append(STATIC_HEADERS, sizeof(STATIC_HEADERS) - 1);
+  head.append("Content-Type: ");
+  head.append(contentType);
+  head.append("\r\n");
+
   if (streaming) {
-    setHeader("Transfer-Encoding", "chunked");
+    head.append(CHUNKED_HEADER, sizeof(CHUNKED_HEADER) - 1);
+  } else if (status == 304) {
+    // a 304 never has a body, and a zero Content-Length would describe
+    // the cached representation incorrectly
+    body = "";
   } else {
-    stringstream len;
-    len << body.size();
-    setHeader("Content-Length", len.str());
+    snprintf(number, sizeof(number), "%ld", contentLength >= 0 ? contentLength : (long) body.size());
+    head.append("Content-Length: ");
+    head.append(number);
+    head.append("\r\n");
   }
 
-  out << "HTTP/1.1 " << status << " " << statusToString() << "\r\n";
-  map<string, string>::iterator iter;
-  for(iter = headers.begin(); iter != headers.end(); iter++) {
-    out << iter->first << ": " << iter->second << "\r\n";
+  pmr::map<pmr::string, pmr::string, less<> >::iterator iter;
+  for (iter = headers.begin(); iter != headers.end(); iter++) {
+    head.append(iter->first);
+    head.append(": ");
+    head.append(iter->second);
+    head.append("\r\n");
   }
-  out << "\r\n";
-  if (body.size() > 0 && !streaming) {
-    out << body;
+  head.append("\r\n");
+
+  return head;
+}
+
+string HTTPResponse::response() {
+  string out(formatHeaders());
+  if (body.size() > 0 && !streaming && !omitBody) {
+    out += body;
   }
 
-  return out.str();
+  return out;
 }
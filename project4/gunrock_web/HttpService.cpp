@@ -4,7 +4,9 @@
 #include <stdio.h>
 
 #include "HttpService.h"
+#include "HttpUtils.h"
 #include "ClientError.h"
+#include "StringUtils.h"
 
 using namespace std;
 
@@ -46,3 +48,78 @@ void HttpService::move(HTTPRequest *request, HTTPResponse *response) {
   throw ClientError::methodNotAllowed();
 }
 
+void HttpService::copy(HTTPRequest *request, HTTPResponse *response) {
+  cout << "COPY " << request->getPath() << endl;
+  throw ClientError::methodNotAllowed();
+}
+
+
+bool HttpService::notModified(HTTPRequest *request, HTTPResponse *response,
+                              string etag, time_t lastModified) {
+  response->setHeader("ETag", etag);
+  if (lastModified >= 0) {
+    response->setHeader("Last-Modified", HttpUtils::httpDate(lastModified));
+  }
+
+  if (!request->isGet() && !request->isHead()) {
+    return false;
+  }
+
+  if (request->hasHeader("If-None-Match")) {
+    // weak comparison, W/"x" matches "x"
+    vector<string> tags = StringUtils::split(string(request->getHeader("If-None-Match")), ',');
+    for (unsigned int idx = 0; idx < tags.size(); idx++) {
+      string tag = tags[idx];
+      size_t start = tag.find_first_not_of(" \t");
+      if (start == string::npos) {
+        continue;
+      }
+      tag = tag.substr(start, tag.find_last_not_of(" \t") - start + 1);
+      if (tag.find("W/") == 0) {
+        tag = tag.substr(2);
+      }
+      if (tag == "*" || tag == etag) {
+        response->setStatus(304);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  if (lastModified >= 0 && request->hasHeader("If-Modified-Since")) {
+    time_t since = HttpUtils::parseHttpDate(string(request->getHeader("If-Modified-Since")));
+    if (since >= 0 && lastModified <= since) {
+      response->setStatus(304);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool HttpService::rangeRequested(HTTPRequest *request, HTTPResponse *response, long size,
+                                 string etag, vector<ByteRange> &ranges) {
+  response->setHeader("Accept-Ranges", "bytes");
+
+  if (!request->isGet() && !request->isHead()) {
+    return false;
+  }
+
+  // If-Range: only honor the range if the client's copy is still current
+  if (request->hasHeader("If-Range") && request->getHeader("If-Range") != etag) {
+    return false;
+  }
+
+  if (!request->getByteRanges(size, ranges)) {
+    return false;
+  }
+
+  if (ranges.size() == 0) {
+    char contentRange[64];
+    snprintf(contentRange, sizeof(contentRange), "bytes */%ld", size);
+    response->setHeader("Content-Range", contentRange);
+    throw ClientError::rangeNotSatisfiable();
+  }
+
+  return true;
+}
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <string.h>
 
 #include "HttpUtils.h"
 
@@ -29,19 +30,45 @@ map<string, string> HttpUtils::params(string query) {
 void HttpUtils::writeChunk(MySocket *client,
 				      const void *buf, int numBytes) {
 
-  char chunkHeader[256];
-  snprintf(chunkHeader, sizeof(chunkHeader), "%x\r\n", numBytes);
-  client->write(chunkHeader);
+  char chunkHeader[32];
+  int headerLen = snprintf(chunkHeader, sizeof(chunkHeader), "%x\r\n", numBytes);
+  struct iovec iov[3];
+  int iovcnt = 0;
+
+  // size line, data and trailing CRLF in one write
+  iov[iovcnt].iov_base = chunkHeader;
+  iov[iovcnt++].iov_len = headerLen;
   if (buf != NULL && numBytes > 0) {
-    client->write(string((const char *) buf, numBytes));
+    iov[iovcnt].iov_base = (void *) buf;
+    iov[iovcnt++].iov_len = numBytes;
   }
-  client->write("\r\n");
+  iov[iovcnt].iov_base = (void *) "\r\n";
+  iov[iovcnt++].iov_len = 2;
+  client->writev(iov, iovcnt);
 }
 
 void HttpUtils::writeLastChunk(MySocket *client) {
   writeChunk(client, NULL, 0);
 }
 
+string HttpUtils::httpDate(time_t when) {
+  struct tm tm;
+  char buf[64];
+  gmtime_r(&when, &tm);
+  strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return buf;
+}
+
+time_t HttpUtils::parseHttpDate(string date) {
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  const char *end = strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == NULL || *end != '\0') {
+    return -1;
+  }
+  return timegm(&tm);
+}
+
 
 // split lifted from stackoverflow
 // http://stackoverflow.com/questions/236129/split-a-string-in-c
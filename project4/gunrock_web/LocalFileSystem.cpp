@@ -72,8 +72,49 @@ void LocalFileSystem::writeInodeRegion(super_t *super, inode_t *inodes)
   }
 }
 
+void LocalFileSystem::countBlockReferences(super_t *super, unsigned char *inodeBitmap, inode_t *inodes,
+                                           vector<int> &references)
+{
+  references.assign(super->num_data, 0);
+  for (int i = 0; i < super->num_inodes; ++i)
+  {
+    if (!(inodeBitmap[i / 8] & (1 << (i % 8))))
+    {
+      continue;
+    }
+    // Pointers past the size can hold anything
+    int blocks = min((inodes[i].size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE, DIRECT_PTRS);
+    for (int j = 0; j < blocks; ++j)
+    {
+      int relative_block = inodes[i].direct[j] - super->data_region_addr;
+      if (relative_block >= 0 && relative_block < super->num_data)
+      {
+        references[relative_block]++;
+      }
+    }
+  }
+}
+
+// Marks the first free data block allocated and returns its address, or
+// -1 if the disk is full
+static int allocateBlock(super_t *super, unsigned char *dataBitmap)
+{
+  for (int j = 0; j < super->num_data; ++j)
+  {
+    int byte_idx = j / 8;
+    int bit_idx = j % 8;
+    if (!(dataBitmap[byte_idx] & (1 << bit_idx)))
+    {
+      dataBitmap[byte_idx] |= (1 << bit_idx);
+      return super->data_region_addr + j;
+    }
+  }
+  return -1;
+}
+
 int LocalFileSystem::lookup(int parentInodeNumber, std::string name)
 {
+  fsStats.add(FS_LOOKUPS);
   // Read the superblock
   super_t super;
   readSuperBlock(&super);
@@ -127,6 +168,7 @@ int LocalFileSystem::lookup(int parentInodeNumber, std::string name)
 
 int LocalFileSystem::stat(int inodeNumber, inode_t *inode)
 {
+  fsStats.add(FS_STATS);
   // Read the superblock
   super_t super;
   readSuperBlock(&super);
@@ -163,6 +205,7 @@ int LocalFileSystem::stat(int inodeNumber, inode_t *inode)
 
 int LocalFileSystem::read(int inodeNumber, void *buffer, int size)
 {
+  fsStats.add(FS_READS);
   // Invalid size
   if (size < 0)
   {
@@ -224,8 +267,59 @@ int LocalFileSystem::read(int inodeNumber, void *buffer, int size)
   return bytesRead;
 }
 
+int LocalFileSystem::readAt(int inodeNumber, void *buffer, int size, int offset)
+{
+  fsStats.add(FS_READS);
+  if (size < 0 || offset < 0)
+  {
+    return -EINVALIDSIZE;
+  }
+
+  // stat does the inode number and allocation checks for us
+  inode_t inode;
+  if (this->stat(inodeNumber, &inode) != 0)
+  {
+    return -EINVALIDINODE;
+  }
+
+  if (inode.type == UFS_DIRECTORY && (size % sizeof(dir_ent_t) || offset % sizeof(dir_ent_t)))
+  {
+    return -EINVALIDSIZE;
+  }
+
+  if (offset >= inode.size)
+  {
+    return 0;
+  }
+
+  // Only read the blocks that overlap the requested range
+  int bytesToRead = min(size, inode.size - offset);
+  int bytesRead = 0;
+  unsigned char blockBuffer[UFS_BLOCK_SIZE];
+
+  while (bytesRead < bytesToRead)
+  {
+    int position = offset + bytesRead;
+    int blockIndex = position / UFS_BLOCK_SIZE;
+    int blockOffset = position % UFS_BLOCK_SIZE;
+    if (blockIndex >= DIRECT_PTRS || inode.direct[blockIndex] == 0)
+    {
+      break;
+    }
+
+    this->disk->readBlock(inode.direct[blockIndex], blockBuffer);
+
+    int bytesInBlock = min(UFS_BLOCK_SIZE - blockOffset, bytesToRead - bytesRead);
+    memcpy(static_cast<char *>(buffer) + bytesRead, blockBuffer + blockOffset, bytesInBlock);
+    bytesRead += bytesInBlock;
+  }
+
+  return bytesRead;
+}
+
 int LocalFileSystem::create(int parentInodeNumber, int type, std::string name)
 {
+  fsStats.add(FS_CREATES);
   // Read super block
   super_t super;
   readSuperBlock(&super);
@@ -377,6 +471,7 @@ int LocalFileSystem::create(int parentInodeNumber, int type, std::string name)
 
 int LocalFileSystem::write(int inodeNumber, const void *buffer, int size)
 {
+  fsStats.add(FS_WRITES);
   if (size < 0)
   {
     return -EINVALIDSIZE;
@@ -425,35 +520,46 @@ int LocalFileSystem::write(int inodeNumber, const void *buffer, int size)
   unsigned char data_bitmap[super.data_bitmap_len * UFS_BLOCK_SIZE];
   readDataBitmap(&super, data_bitmap);
 
-  // Allocate additional blocks if needed
-  for (int i = current_blocks; i < required_blocks; ++i)
+  // Blocks shared with a copy can't be overwritten or freed, so this file
+  // gets new ones in their place (copy-on-write, but every write replaces
+  // the whole block so nothing needs copying)
+  vector<int> references;
+  countBlockReferences(&super, inode_bitmap, inodes, references);
+  for (int i = 0; i < min(current_blocks, required_blocks); ++i)
   {
-    int free_block = -1;
-    for (int j = 0; j < super.num_data; ++j)
+    int relative_block = inode.direct[i] - super.data_region_addr;
+    if (relative_block < 0 || relative_block >= super.num_data || references[relative_block] > 1)
     {
-      int byte_idx = j / 8;
-      int bit_idx = j % 8;
-      if (!(data_bitmap[byte_idx] & (1 << bit_idx)))
+      int new_block = allocateBlock(&super, data_bitmap);
+      if (new_block == -1)
       {
-        free_block = j;
-        data_bitmap[byte_idx] |= (1 << bit_idx);
-        break;
+        return -ENOTENOUGHSPACE; // Not enough space
       }
+      inode.direct[i] = new_block;
     }
-    if (free_block == -1)
+  }
+
+  // Allocate additional blocks if needed
+  for (int i = current_blocks; i < required_blocks; ++i)
+  {
+    int new_block = allocateBlock(&super, data_bitmap);
+    if (new_block == -1)
     {
       return -ENOTENOUGHSPACE; // Not enough space
     }
-    inode.direct[i] = super.data_region_addr + free_block;
+    inode.direct[i] = new_block;
   }
 
-  // Deallocate unused blocks if reducing size
+  // Deallocate unused blocks if reducing size, unless a copy still uses them
   for (int i = required_blocks; i < current_blocks; ++i)
   {
     int relative_block = inode.direct[i] - super.data_region_addr;
-    int byte_idx = relative_block / 8;
-    int bit_idx = relative_block % 8;
-    data_bitmap[byte_idx] &= ~(0b1 << bit_idx);
+    if (relative_block >= 0 && relative_block < super.num_data && references[relative_block] <= 1)
+    {
+      int byte_idx = relative_block / 8;
+      int bit_idx = relative_block % 8;
+      data_bitmap[byte_idx] &= ~(0b1 << bit_idx);
+    }
     inode.direct[i] = 0;
   }
 
@@ -483,6 +589,7 @@ int LocalFileSystem::write(int inodeNumber, const void *buffer, int size)
 
 int LocalFileSystem::unlink(int parentInodeNumber, std::string name)
 {
+  fsStats.add(FS_UNLINKS);
   // Read super block
   super_t super;
   readSuperBlock(&super);
@@ -547,10 +654,24 @@ int LocalFileSystem::unlink(int parentInodeNumber, std::string name)
     return -EDIRNOTEMPTY; // Cannot remove a non-empty directory
   }
 
+  // Only the pointers covered by the size are in use, the rest can hold
+  // anything (mkfs leaves garbage there)
+  int targetBlocks = (targetInode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  if (targetBlocks > DIRECT_PTRS)
+  {
+    targetBlocks = DIRECT_PTRS;
+  }
+
   // Mark the inode as free in the inode bitmap
   unsigned char inodeBitmap[super.inode_bitmap_len * UFS_BLOCK_SIZE];
   readInodeBitmap(&super, inodeBitmap);
 
+  // Blocks shared with a copy stay allocated
+  inode_t inodes[super.inode_region_len * UFS_BLOCK_SIZE / sizeof(inode_t)];
+  readInodeRegion(&super, inodes);
+  vector<int> references;
+  countBlockReferences(&super, inodeBitmap, inodes, references);
+
   int inodeIndex = entries[entryIndex].inum;
   int byteIndex = inodeIndex / 8;
   int bitOffset = inodeIndex % 8;
@@ -563,9 +684,13 @@ int LocalFileSystem::unlink(int parentInodeNumber, std::string name)
     unsigned char dataBitmap[super.data_bitmap_len * UFS_BLOCK_SIZE];
     readDataBitmap(&super, dataBitmap);
 
-    for (int i = 0; i < DIRECT_PTRS && targetInode.direct[i] != 0; ++i)
+    for (int i = 0; i < targetBlocks; ++i)
     {
       int dataIndex = targetInode.direct[i] - super.data_region_addr;
+      if (dataIndex < 0 || dataIndex >= super.num_data || references[dataIndex] > 1)
+      {
+        continue;
+      }
       int byteIdx = dataIndex / 8;
       int bitIdx = dataIndex % 8;
       dataBitmap[byteIdx] &= ~(1 << bitIdx);
@@ -578,7 +703,7 @@ int LocalFileSystem::unlink(int parentInodeNumber, std::string name)
   {
     unsigned char dataBitmap[super.data_bitmap_len * UFS_BLOCK_SIZE];
     readDataBitmap(&super, dataBitmap);
-    for (int i = 0; i < DIRECT_PTRS && targetInode.direct[i] != 0; ++i)
+    for (int i = 0; i < targetBlocks; ++i)
     {
       int dataIndex = targetInode.direct[i] - super.data_region_addr;
       int byteIndex = dataIndex / 8;
@@ -601,10 +726,226 @@ int LocalFileSystem::unlink(int parentInodeNumber, std::string name)
   disk->writeBlock(parentInode.direct[0], dirBlock);
 
   // Update parent inode size
+  inodes[parentInodeNumber] = parentInode;
+  writeInodeRegion(&super, inodes);
+
+  return 0;
+}
+
+int LocalFileSystem::rename(int srcParentInodeNumber, std::string srcName, int dstParentInodeNumber, std::string dstName)
+{
+  fsStats.add(FS_RENAMES);
+  // Read super block
+  super_t super;
+  readSuperBlock(&super);
+
+  // Check for special cases: '.' and '..'
+  if (srcName == "." || srcName == ".." || dstName == "." || dstName == "..")
+  {
+    return -EUNLINKNOTALLOWED;
+  }
+
+  // Check if the new name is valid
+  if (dstName.empty() || dstName.length() >= DIR_ENT_NAME_SIZE)
+  {
+    return -EINVALIDNAME;
+  }
+
+  // Both parents have to be directories
+  inode_t srcParentInode;
+  inode_t dstParentInode;
+  if (this->stat(srcParentInodeNumber, &srcParentInode) != 0 || srcParentInode.type != UFS_DIRECTORY ||
+      this->stat(dstParentInodeNumber, &dstParentInode) != 0 || dstParentInode.type != UFS_DIRECTORY)
+  {
+    return -EINVALIDINODE;
+  }
+
+  // Find what we're moving
+  int inodeNumber = this->lookup(srcParentInodeNumber, srcName);
+  if (inodeNumber < 0)
+  {
+    return -ENOTFOUND;
+  }
+  inode_t inode;
+  this->stat(inodeNumber, &inode);
+
+  // A directory can't move under itself, so walk up from the new parent
+  // to the root looking for it
+  if (inode.type == UFS_DIRECTORY)
+  {
+    int ancestor = dstParentInodeNumber;
+    for (int depth = 0; ancestor != UFS_ROOT_DIRECTORY_INODE_NUMBER; depth++)
+    {
+      if (ancestor == inodeNumber)
+      {
+        return -EINVALIDMOVE;
+      }
+      ancestor = this->lookup(ancestor, "..");
+      if (ancestor < 0 || depth >= super.num_inodes)
+      {
+        return -EINVALIDINODE;
+      }
+    }
+  }
+
+  // Replace whatever already has the new name
+  int existingInode = this->lookup(dstParentInodeNumber, dstName);
+  if (existingInode == inodeNumber)
+  {
+    return 0;
+  }
+  if (existingInode >= 0)
+  {
+    inode_t existingInodeData;
+    this->stat(existingInode, &existingInodeData);
+    if (existingInodeData.type != inode.type)
+    {
+      return -EINVALIDTYPE;
+    }
+    int unlinkResult = this->unlink(dstParentInodeNumber, dstName);
+    if (unlinkResult != 0)
+    {
+      return unlinkResult;
+    }
+    // unlink changed the parent's size
+    this->stat(srcParentInodeNumber, &srcParentInode);
+    this->stat(dstParentInodeNumber, &dstParentInode);
+  }
+  else if (srcParentInodeNumber != dstParentInodeNumber &&
+           dstParentInode.size + sizeof(dir_ent_t) > UFS_BLOCK_SIZE)
+  {
+    return -ENOTENOUGHSPACE; // Directory entries only live in the first block
+  }
+
+  // Find the old entry
+  char srcDirBlock[UFS_BLOCK_SIZE] = {0};
+  disk->readBlock(srcParentInode.direct[0], srcDirBlock);
+  dir_ent_t *srcEntries = reinterpret_cast<dir_ent_t *>(srcDirBlock);
+  int srcEntryCount = srcParentInode.size / sizeof(dir_ent_t);
+  int entryIndex = -1;
+  for (int i = 0; i < srcEntryCount; ++i)
+  {
+    if (strncmp(srcEntries[i].name, srcName.c_str(), DIR_ENT_NAME_SIZE) == 0)
+    {
+      entryIndex = i;
+      break;
+    }
+  }
+  if (entryIndex == -1)
+  {
+    return -ENOTFOUND;
+  }
+
+  if (srcParentInodeNumber == dstParentInodeNumber)
+  {
+    // Same directory, just rename the entry in place
+    memset(srcEntries[entryIndex].name, 0, DIR_ENT_NAME_SIZE);
+    strncpy(srcEntries[entryIndex].name, dstName.c_str(), DIR_ENT_NAME_SIZE - 1);
+    disk->writeBlock(srcParentInode.direct[0], srcDirBlock);
+    return 0;
+  }
+
+  // Remove the old entry by shifting subsequent entries left
+  for (int i = entryIndex; i < srcEntryCount - 1; ++i)
+  {
+    srcEntries[i] = srcEntries[i + 1];
+  }
+  memset(&srcEntries[srcEntryCount - 1], 0, sizeof(dir_ent_t));
+  srcParentInode.size -= sizeof(dir_ent_t);
+  disk->writeBlock(srcParentInode.direct[0], srcDirBlock);
+
+  // Add the new entry to the end of the new parent
+  dir_ent_t newEntry = {};
+  strncpy(newEntry.name, dstName.c_str(), DIR_ENT_NAME_SIZE - 1);
+  newEntry.inum = inodeNumber;
+
+  char dstDirBlock[UFS_BLOCK_SIZE];
+  disk->readBlock(dstParentInode.direct[0], dstDirBlock);
+  memcpy(dstDirBlock + dstParentInode.size, &newEntry, sizeof(newEntry));
+  disk->writeBlock(dstParentInode.direct[0], dstDirBlock);
+  dstParentInode.size += sizeof(dir_ent_t);
+
+  // A directory's '..' has to follow it
+  if (inode.type == UFS_DIRECTORY)
+  {
+    char dirBlock[UFS_BLOCK_SIZE];
+    disk->readBlock(inode.direct[0], dirBlock);
+    dir_ent_t *entries = reinterpret_cast<dir_ent_t *>(dirBlock);
+    for (unsigned int i = 0; i < static_cast<unsigned int>(inode.size / sizeof(dir_ent_t)); ++i)
+    {
+      if (strncmp(entries[i].name, "..", DIR_ENT_NAME_SIZE) == 0)
+      {
+        entries[i].inum = dstParentInodeNumber;
+        break;
+      }
+    }
+    disk->writeBlock(inode.direct[0], dirBlock);
+  }
+
+  // Update both parents' sizes
   inode_t inodes[super.inode_region_len * UFS_BLOCK_SIZE / sizeof(inode_t)];
   readInodeRegion(&super, inodes);
-  inodes[parentInodeNumber] = parentInode;
+  inodes[srcParentInodeNumber] = srcParentInode;
+  inodes[dstParentInodeNumber] = dstParentInode;
   writeInodeRegion(&super, inodes);
 
   return 0;
-}
\ No newline at end of file
+}
+
+int LocalFileSystem::copy(int srcInodeNumber, int dstParentInodeNumber, std::string dstName)
+{
+  fsStats.add(FS_COPIES);
+  // Only files can be copied
+  inode_t srcInode;
+  if (this->stat(srcInodeNumber, &srcInode) != 0)
+  {
+    return -EINVALIDINODE;
+  }
+  if (srcInode.type != UFS_REGULAR_FILE)
+  {
+    return -EINVALIDTYPE;
+  }
+
+  // The copy is a new file, or an existing one we replace the contents of
+  int dstInodeNumber = this->create(dstParentInodeNumber, UFS_REGULAR_FILE, dstName);
+  if (dstInodeNumber < 0)
+  {
+    return dstInodeNumber;
+  }
+  if (dstInodeNumber == srcInodeNumber)
+  {
+    return 0;
+  }
+
+  // Read super block
+  super_t super;
+  readSuperBlock(&super);
+
+  unsigned char inodeBitmap[super.inode_bitmap_len * UFS_BLOCK_SIZE];
+  readInodeBitmap(&super, inodeBitmap);
+  inode_t inodes[super.inode_region_len * UFS_BLOCK_SIZE / sizeof(inode_t)];
+  readInodeRegion(&super, inodes);
+  unsigned char dataBitmap[super.data_bitmap_len * UFS_BLOCK_SIZE];
+  readDataBitmap(&super, dataBitmap);
+
+  // Free the blocks the old contents had to themselves
+  vector<int> references;
+  countBlockReferences(&super, inodeBitmap, inodes, references);
+  inode_t &dstInode = inodes[dstInodeNumber];
+  int dstBlocks = min((dstInode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE, DIRECT_PTRS);
+  for (int i = 0; i < dstBlocks; ++i)
+  {
+    int dataIndex = dstInode.direct[i] - super.data_region_addr;
+    if (dataIndex >= 0 && dataIndex < super.num_data && references[dataIndex] <= 1)
+    {
+      dataBitmap[dataIndex / 8] &= ~(1 << (dataIndex % 8));
+    }
+  }
+  writeDataBitmap(&super, dataBitmap);
+
+  // Point at the source's blocks
+  dstInode = srcInode;
+  writeInodeRegion(&super, inodes);
+
+  return 0;
+}
@@ -0,0 +1,297 @@
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "Metrics.h"
+#include "http_parser.h"
+
+using namespace std;
+
+#define MAX_METRICS_THREADS (1024)
+
+// upper bounds of the latency buckets in nanoseconds, plus +Inf
+static const uint64_t BUCKET_BOUNDS[] = {
+  100000, 250000, 500000,
+  1000000, 2500000, 5000000,
+  10000000, 25000000, 50000000,
+  100000000, 250000000, 500000000,
+  1000000000, 2500000000, 5000000000, 10000000000
+};
+#define NUM_BOUNDS (sizeof(BUCKET_BOUNDS) / sizeof(BUCKET_BOUNDS[0]))
+#define NUM_BUCKETS (NUM_BOUNDS + 1)
+
+static const char *PHASE_NAMES[NUM_PHASES] = { "queue", "parse", "service", "write" };
+
+// methods we track by name, everything else is "OTHER"
+static const int METHODS[] = { HTTP_DELETE, HTTP_GET, HTTP_HEAD, HTTP_POST,
+                               HTTP_PUT, HTTP_MOVE, HTTP_COPY };
+static const char *METHOD_NAMES[] = { "DELETE", "GET", "HEAD", "POST",
+                                      "PUT", "MOVE", "COPY", "OTHER" };
+#define NUM_METHODS (sizeof(METHOD_NAMES) / sizeof(METHOD_NAMES[0]))
+
+// status codes the server can send, anything else is counted as "other"
+static const int STATUSES[] = { 200, 201, 204, 206, 304, 400, 401, 403, 404, 405,
+                                408, 409, 412, 413, 416, 431, 500, 501, 503, 507 };
+#define NUM_STATUSES (sizeof(STATUSES) / sizeof(STATUSES[0]))
+
+// only the owning thread writes, so a relaxed load and store is enough
+// and avoids a locked read-modify-write
+struct Counter {
+  atomic<uint64_t> value{0};
+  void add(uint64_t n) { value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed); }
+  uint64_t get() { return value.load(memory_order_relaxed); }
+};
+
+struct Histogram {
+  Counter buckets[NUM_BUCKETS];
+  Counter sum;
+};
+
+struct RouteMethodMetrics {
+  Histogram phases[NUM_PHASES];
+  Counter statuses[NUM_STATUSES + 1];
+  Counter bytesIn;
+  Counter bytesOut;
+};
+
+struct ThreadMetrics {
+  size_t numRoutes;
+  RouteMethodMetrics *slots;
+  Counter opened;
+  Counter closed;
+};
+
+struct Route {
+  const void *key;
+  string name;
+};
+
+// route 0 catches requests that matched no service
+static vector<Route> routes = { { NULL, "none" } };
+static vector<function<void(string &)> > collectors;
+static atomic<int> numThreads(0);
+static atomic<ThreadMetrics *> threadMetrics[MAX_METRICS_THREADS];
+static thread_local ThreadMetrics *myMetrics = NULL;
+
+static ThreadMetrics *mine() {
+  if (myMetrics == NULL) {
+    int idx = numThreads.fetch_add(1);
+    ThreadMetrics *metrics = new ThreadMetrics;
+    metrics->numRoutes = routes.size();
+    metrics->slots = new RouteMethodMetrics[routes.size() * NUM_METHODS];
+    if (idx < MAX_METRICS_THREADS) {
+      threadMetrics[idx].store(metrics, memory_order_release);
+    }
+    // past the limit we still record, it just never gets rendered
+    myMetrics = metrics;
+  }
+  return myMetrics;
+}
+
+static size_t methodSlot(int method) {
+  for (size_t idx = 0; idx < NUM_METHODS - 1; idx++) {
+    if (METHODS[idx] == method) {
+      return idx;
+    }
+  }
+  return NUM_METHODS - 1;
+}
+
+static RouteMethodMetrics *slot(int route, int method) {
+  ThreadMetrics *metrics = mine();
+  if (route < 0 || (size_t) route >= metrics->numRoutes) {
+    route = 0;
+  }
+  return &metrics->slots[route * NUM_METHODS + methodSlot(method)];
+}
+
+int Metrics::addRoute(const void *key, string name) {
+  Route route = { key, name };
+  routes.push_back(route);
+  return routes.size() - 1;
+}
+
+int Metrics::routeId(const void *key) {
+  for (size_t idx = 1; idx < routes.size(); idx++) {
+    if (routes[idx].key == key) {
+      return idx;
+    }
+  }
+  return 0;
+}
+
+void Metrics::addCollector(function<void(string &)> collector) {
+  collectors.push_back(collector);
+}
+
+void Metrics::observe(int route, int method, RequestPhase phase, uint64_t nanos) {
+  Histogram &histogram = slot(route, method)->phases[phase];
+  size_t bucket = 0;
+  while (bucket < NUM_BOUNDS && nanos > BUCKET_BOUNDS[bucket]) {
+    bucket++;
+  }
+  histogram.buckets[bucket].add(1);
+  histogram.sum.add(nanos);
+}
+
+void Metrics::countResponse(int route, int method, int status,
+                            unsigned long bytesIn, unsigned long bytesOut) {
+  RouteMethodMetrics *metrics = slot(route, method);
+  size_t statusSlot = 0;
+  while (statusSlot < NUM_STATUSES && STATUSES[statusSlot] != status) {
+    statusSlot++;
+  }
+  metrics->statuses[statusSlot].add(1);
+  metrics->bytesIn.add(bytesIn);
+  metrics->bytesOut.add(bytesOut);
+}
+
+void Metrics::connectionOpened() {
+  mine()->opened.add(1);
+}
+
+void Metrics::connectionClosed() {
+  mine()->closed.add(1);
+}
+
+uint64_t Metrics::now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void appendf(string &out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void appendf(string &out, const char *format, ...) {
+  char line[512];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (length > 0) {
+    out.append(line, min((size_t) length, sizeof(line) - 1));
+  }
+}
+
+string Metrics::render() {
+  size_t numSlots = routes.size() * NUM_METHODS;
+  vector<RouteMethodMetrics> totals(numSlots);
+  uint64_t opened = 0;
+  uint64_t closed = 0;
+
+  int threads = min(numThreads.load(memory_order_acquire), MAX_METRICS_THREADS);
+  for (int idx = 0; idx < threads; idx++) {
+    ThreadMetrics *metrics = threadMetrics[idx].load(memory_order_acquire);
+    if (metrics == NULL) {
+      continue;
+    }
+    opened += metrics->opened.get();
+    closed += metrics->closed.get();
+    for (size_t s = 0; s < metrics->numRoutes * NUM_METHODS && s < numSlots; s++) {
+      RouteMethodMetrics &from = metrics->slots[s];
+      RouteMethodMetrics &to = totals[s];
+      for (int phase = 0; phase < NUM_PHASES; phase++) {
+        for (size_t b = 0; b < NUM_BUCKETS; b++) {
+          to.phases[phase].buckets[b].add(from.phases[phase].buckets[b].get());
+        }
+        to.phases[phase].sum.add(from.phases[phase].sum.get());
+      }
+      for (size_t st = 0; st <= NUM_STATUSES; st++) {
+        to.statuses[st].add(from.statuses[st].get());
+      }
+      to.bytesIn.add(from.bytesIn.get());
+      to.bytesOut.add(from.bytesOut.get());
+    }
+  }
+
+  string out;
+  out.reserve(16 * 1024);
+
+  out += "# HELP gunrock_request_duration_seconds Time spent in each phase of a request.\n";
+  out += "# TYPE gunrock_request_duration_seconds histogram\n";
+  for (size_t s = 0; s < numSlots; s++) {
+    const char *route = routes[s / NUM_METHODS].name.c_str();
+    const char *method = METHOD_NAMES[s % NUM_METHODS];
+    for (int phase = 0; phase < NUM_PHASES; phase++) {
+      Histogram &histogram = totals[s].phases[phase];
+      uint64_t count = 0;
+      for (size_t b = 0; b < NUM_BUCKETS; b++) {
+        count += histogram.buckets[b].get();
+      }
+      if (count == 0) {
+        continue;
+      }
+      uint64_t cumulative = 0;
+      for (size_t b = 0; b < NUM_BUCKETS; b++) {
+        cumulative += histogram.buckets[b].get();
+        if (b < NUM_BOUNDS) {
+          appendf(out, "gunrock_request_duration_seconds_bucket{route=\"%s\",method=\"%s\",phase=\"%s\",le=\"%g\"} %lu\n",
+                  route, method, PHASE_NAMES[phase], BUCKET_BOUNDS[b] / 1e9, (unsigned long) cumulative);
+        } else {
+          appendf(out, "gunrock_request_duration_seconds_bucket{route=\"%s\",method=\"%s\",phase=\"%s\",le=\"+Inf\"} %lu\n",
+                  route, method, PHASE_NAMES[phase], (unsigned long) cumulative);
+        }
+      }
+      appendf(out, "gunrock_request_duration_seconds_sum{route=\"%s\",method=\"%s\",phase=\"%s\"} %.9f\n",
+              route, method, PHASE_NAMES[phase], histogram.sum.get() / 1e9);
+      appendf(out, "gunrock_request_duration_seconds_count{route=\"%s\",method=\"%s\",phase=\"%s\"} %lu\n",
+              route, method, PHASE_NAMES[phase], (unsigned long) count);
+    }
+  }
+
+  out += "# HELP gunrock_responses_total Responses sent, by status code.\n";
+  out += "# TYPE gunrock_responses_total counter\n";
+  for (size_t s = 0; s < numSlots; s++) {
+    for (size_t st = 0; st <= NUM_STATUSES; st++) {
+      uint64_t count = totals[s].statuses[st].get();
+      if (count == 0) {
+        continue;
+      }
+      char code[16];
+      if (st < NUM_STATUSES) {
+        snprintf(code, sizeof(code), "%d", STATUSES[st]);
+      } else {
+        snprintf(code, sizeof(code), "other");
+      }
+      appendf(out, "gunrock_responses_total{route=\"%s\",method=\"%s\",code=\"%s\"} %lu\n",
+              routes[s / NUM_METHODS].name.c_str(), METHOD_NAMES[s % NUM_METHODS], code,
+              (unsigned long) count);
+    }
+  }
+
+  out += "# HELP gunrock_received_bytes_total Request bytes read from clients.\n";
+  out += "# TYPE gunrock_received_bytes_total counter\n";
+  for (size_t s = 0; s < numSlots; s++) {
+    if (totals[s].bytesIn.get() > 0) {
+      appendf(out, "gunrock_received_bytes_total{route=\"%s\",method=\"%s\"} %lu\n",
+              routes[s / NUM_METHODS].name.c_str(), METHOD_NAMES[s % NUM_METHODS],
+              (unsigned long) totals[s].bytesIn.get());
+    }
+  }
+
+  out += "# HELP gunrock_sent_bytes_total Response bytes written to clients.\n";
+  out += "# TYPE gunrock_sent_bytes_total counter\n";
+  for (size_t s = 0; s < numSlots; s++) {
+    if (totals[s].bytesOut.get() > 0) {
+      appendf(out, "gunrock_sent_bytes_total{route=\"%s\",method=\"%s\"} %lu\n",
+              routes[s / NUM_METHODS].name.c_str(), METHOD_NAMES[s % NUM_METHODS],
+              (unsigned long) totals[s].bytesOut.get());
+    }
+  }
+
+  // threads are summed one at a time, so a connection can be seen closed
+  // before it is seen opened
+  out += "# HELP gunrock_active_connections Connections accepted and not yet closed.\n";
+  out += "# TYPE gunrock_active_connections gauge\n";
+  appendf(out, "gunrock_active_connections %ld\n", (long) (opened >= closed ? opened - closed : 0));
+
+  for (size_t idx = 0; idx < collectors.size(); idx++) {
+    collectors[idx](out);
+  }
+
+  return out;
+}
@@ -0,0 +1,17 @@
+#include "MetricsService.h"
+#include "Metrics.h"
+
+using namespace std;
+
+MetricsService::MetricsService() : HttpService("/metrics") {
+}
+
+void MetricsService::get(HTTPRequest *request, HTTPResponse *response) {
+  response->setContentType("text/plain; version=0.0.4; charset=utf-8");
+  response->setHeader("Cache-Control", "no-store");
+  response->setBody(Metrics::render());
+}
+
+void MetricsService::head(HTTPRequest *request, HTTPResponse *response) {
+  get(request, response);
+}
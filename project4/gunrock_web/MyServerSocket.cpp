@@ -3,12 +3,13 @@
 #include <sys/socket.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-MyServerSocket::MyServerSocket(int port)
+MyServerSocket::MyServerSocket(int port, const ServerSocketOptions &options)
 {
     struct sockaddr_in server;
     int one = 1;
@@ -23,6 +24,23 @@ MyServerSocket::MyServerSocket(int port)
     if (setsockopt(serverFd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(int)) == -1) {
       throw SocketError("error with set socket opts");
     }
+
+    if (options.reusePort &&
+        setsockopt(serverFd,SOL_SOCKET,SO_REUSEPORT,&one,sizeof(int)) == -1) {
+      throw SocketError("could not set SO_REUSEPORT");
+    }
+
+    if (options.deferAcceptSeconds > 0 &&
+        setsockopt(serverFd,IPPROTO_TCP,TCP_DEFER_ACCEPT,
+                   &options.deferAcceptSeconds,sizeof(int)) == -1) {
+      throw SocketError("could not set TCP_DEFER_ACCEPT");
+    }
+
+    if (options.fastOpenQueue > 0 &&
+        setsockopt(serverFd,IPPROTO_TCP,TCP_FASTOPEN,
+                   &options.fastOpenQueue,sizeof(int)) == -1) {
+      throw SocketError("could not set TCP_FASTOPEN");
+    }
     
     if( bind(serverFd,(struct sockaddr *) &server, sizeof(server)) ==-1){
         char str[1024];
@@ -31,7 +49,9 @@ MyServerSocket::MyServerSocket(int port)
     }	
     
     //set up a listen queue
-    listen(serverFd, 10);
+    if (listen(serverFd, options.backlog) == -1) {
+      throw SocketError("could not listen");
+    }
 }
 
 MySocket *MyServerSocket::accept()
@@ -0,0 +1,109 @@
+#include "ObjectCache.h"
+#include "Metrics.h"
+#include "dthread.h"
+
+using namespace std;
+
+ObjectCache::ObjectCache(size_t capacityBytes) {
+  m_capacity = capacityBytes;
+  m_bytes = 0;
+  m_version = 0;
+  m_hits = 0;
+  m_misses = 0;
+  m_evictions = 0;
+  pthread_mutex_init(&m_mutex, NULL);
+  Metrics::addCollector([this](string &out) { renderMetrics(out); });
+}
+
+shared_ptr<const ObjectCache::Entry> ObjectCache::lookup(const string &key) {
+  if (m_capacity == 0) {
+    return NULL;
+  }
+  shared_ptr<const Entry> entry;
+  dthread_mutex_lock(&m_mutex);
+  unordered_map<string, LruList::iterator>::iterator found = m_index.find(key);
+  if (found != m_index.end()) {
+    m_lru.splice(m_lru.begin(), m_lru, found->second);
+    entry = found->second->second;
+    m_hits++;
+  } else {
+    m_misses++;
+  }
+  dthread_mutex_unlock(&m_mutex);
+  return entry;
+}
+
+uint64_t ObjectCache::version() {
+  dthread_mutex_lock(&m_mutex);
+  uint64_t version = m_version;
+  dthread_mutex_unlock(&m_mutex);
+  return version;
+}
+
+void ObjectCache::insert(const string &key, shared_ptr<const Entry> entry, uint64_t version) {
+  if (m_capacity == 0 || entry->bytes() > m_capacity / MAX_ENTRY_FRACTION) {
+    return;
+  }
+  dthread_mutex_lock(&m_mutex);
+  if (version == m_version && m_index.find(key) == m_index.end()) {
+    m_lru.push_front(make_pair(key, entry));
+    m_index[key] = m_lru.begin();
+    m_bytes += entry->bytes();
+    while (m_bytes > m_capacity) {
+      m_bytes -= m_lru.back().second->bytes();
+      m_index.erase(m_lru.back().first);
+      m_lru.pop_back();
+      m_evictions++;
+    }
+  }
+  dthread_mutex_unlock(&m_mutex);
+}
+
+void ObjectCache::invalidate(const string &key) {
+  if (m_capacity == 0) {
+    return;
+  }
+  dthread_mutex_lock(&m_mutex);
+  m_version++;
+  unordered_map<string, LruList::iterator>::iterator found = m_index.find(key);
+  if (found != m_index.end()) {
+    m_bytes -= found->second->second->bytes();
+    m_lru.erase(found->second);
+    m_index.erase(found);
+  }
+  dthread_mutex_unlock(&m_mutex);
+}
+
+void ObjectCache::invalidateTree(const string &key) {
+  if (m_capacity == 0) {
+    return;
+  }
+  string under = key + "/";
+  dthread_mutex_lock(&m_mutex);
+  m_version++;
+  for (LruList::iterator entry = m_lru.begin(); entry != m_lru.end();) {
+    if (entry->first == key || entry->first.compare(0, under.size(), under) == 0) {
+      m_bytes -= entry->second->bytes();
+      m_index.erase(entry->first);
+      entry = m_lru.erase(entry);
+    } else {
+      entry++;
+    }
+  }
+  dthread_mutex_unlock(&m_mutex);
+}
+
+void ObjectCache::renderMetrics(string &out) {
+  dthread_mutex_lock(&m_mutex);
+  out += "# HELP gunrock_ds3_cache_requests_total /ds3/ cache lookups by result.\n";
+  out += "# TYPE gunrock_ds3_cache_requests_total counter\n";
+  out += "gunrock_ds3_cache_requests_total{result=\"hit\"} " + to_string(m_hits) + "\n";
+  out += "gunrock_ds3_cache_requests_total{result=\"miss\"} " + to_string(m_misses) + "\n";
+  out += "# HELP gunrock_ds3_cache_evictions_total Entries evicted to stay under capacity.\n";
+  out += "# TYPE gunrock_ds3_cache_evictions_total counter\n";
+  out += "gunrock_ds3_cache_evictions_total " + to_string(m_evictions) + "\n";
+  out += "# HELP gunrock_ds3_cache_bytes Bytes of bodies and listings in the cache.\n";
+  out += "# TYPE gunrock_ds3_cache_bytes gauge\n";
+  out += "gunrock_ds3_cache_bytes " + to_string(m_bytes) + "\n";
+  dthread_mutex_unlock(&m_mutex);
+}
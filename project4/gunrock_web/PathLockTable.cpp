@@ -0,0 +1,141 @@
+#include <algorithm>
+
+#include "PathLockTable.h"
+#include "dthread.h"
+
+using namespace std;
+
+// compatible[held][requested]
+static const bool compatible[PathLockTable::NUM_MODES][PathLockTable::NUM_MODES] = {
+  //         IS     IX     S      X
+  /* IS */ { true,  true,  true,  false },
+  /* IX */ { true,  true,  false, false },
+  /* S  */ { true,  false, true,  false },
+  /* X  */ { false, false, false, false },
+};
+
+PathLockTable::PathLockTable() {
+  pthread_mutex_init(&m_mutex, NULL);
+}
+
+// whether path comes up in locks before index, so each request queues on
+// a path once however many locks it has there
+static bool seenBefore(const vector<PathLockTable::Lock> &locks, size_t index) {
+  for (size_t idx = 0; idx < index; idx++) {
+    if (locks[idx].path == locks[index].path) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void PathLockTable::plan(const vector<string> &components, size_t depth, Mode mode,
+                         vector<Lock> &locks) {
+  Mode intent = (mode == S || mode == IS) ? IS : IX;
+  string path;
+  for (size_t idx = 0; idx < depth; idx++) {
+    locks.push_back({path, intent});
+    if (idx > 0) {
+      path += "/";
+    }
+    path += components[idx];
+  }
+  locks.push_back({path, mode});
+}
+
+bool PathLockTable::grantable(const vector<Lock> &locks, Waiter *self) {
+  for (size_t idx = 0; idx < locks.size(); idx++) {
+    unordered_map<string, Entry>::iterator entry = m_entries.find(locks[idx].path);
+    if (entry == m_entries.end()) {
+      continue;
+    }
+    Mode mode = locks[idx].mode;
+    for (int held = 0; held < NUM_MODES; held++) {
+      if (entry->second.count[held] > 0 && !compatible[held][mode]) {
+        return false;
+      }
+    }
+    deque<Waiter *> &waiting = entry->second.waiting;
+    for (size_t ahead = 0; ahead < waiting.size() && waiting[ahead] != self; ahead++) {
+      const vector<Lock> &theirs = *waiting[ahead]->locks;
+      for (size_t other = 0; other < theirs.size(); other++) {
+        if (theirs[other].path == locks[idx].path && !compatible[theirs[other].mode][mode]) {
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+void PathLockTable::grant(const vector<Lock> &locks) {
+  for (size_t idx = 0; idx < locks.size(); idx++) {
+    // value-initialized, so new entries start with no holders
+    m_entries[locks[idx].path].count[locks[idx].mode]++;
+  }
+}
+
+void PathLockTable::wake(const vector<Lock> &locks) {
+  for (size_t idx = 0; idx < locks.size(); idx++) {
+    if (seenBefore(locks, idx)) {
+      continue;
+    }
+    unordered_map<string, Entry>::iterator entry = m_entries.find(locks[idx].path);
+    if (entry == m_entries.end()) {
+      continue;
+    }
+    deque<Waiter *> &waiting = entry->second.waiting;
+    for (size_t waiter = 0; waiter < waiting.size(); waiter++) {
+      dthread_cond_signal(&waiting[waiter]->ready);
+    }
+  }
+}
+
+void PathLockTable::acquire(const vector<Lock> &locks) {
+  dthread_mutex_lock(&m_mutex);
+  if (grantable(locks, NULL)) {
+    grant(locks);
+    dthread_mutex_unlock(&m_mutex);
+    return;
+  }
+
+  Waiter self;
+  self.locks = &locks;
+  pthread_cond_init(&self.ready, NULL);
+  for (size_t idx = 0; idx < locks.size(); idx++) {
+    if (!seenBefore(locks, idx)) {
+      m_entries[locks[idx].path].waiting.push_back(&self);
+    }
+  }
+  while (!grantable(locks, &self)) {
+    dthread_cond_wait(&self.ready, &m_mutex);
+  }
+  for (size_t idx = 0; idx < locks.size(); idx++) {
+    if (!seenBefore(locks, idx)) {
+      deque<Waiter *> &waiting = m_entries[locks[idx].path].waiting;
+      waiting.erase(find(waiting.begin(), waiting.end(), &self));
+    }
+  }
+  grant(locks);
+  // requests that were only queued behind us may go now
+  wake(locks);
+  dthread_mutex_unlock(&m_mutex);
+  pthread_cond_destroy(&self.ready);
+}
+
+void PathLockTable::release(const vector<Lock> &locks) {
+  dthread_mutex_lock(&m_mutex);
+  for (size_t idx = 0; idx < locks.size(); idx++) {
+    unordered_map<string, Entry>::iterator entry = m_entries.find(locks[idx].path);
+    entry->second.count[locks[idx].mode]--;
+    bool unused = entry->second.waiting.empty();
+    for (int mode = 0; mode < NUM_MODES; mode++) {
+      unused = unused && entry->second.count[mode] == 0;
+    }
+    if (unused) {
+      m_entries.erase(entry);
+    }
+  }
+  wake(locks);
+  dthread_mutex_unlock(&m_mutex);
+}
@@ -0,0 +1,204 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <iostream>
+#include <algorithm>
+
+#include "ReplicationLog.h"
+#include "dthread.h"
+#include "http_parser.h"
+
+using namespace std;
+
+ReplicationLog::ReplicationLog(string logFile) {
+  pthread_mutex_init(&m_mutex, NULL);
+  m_file = logFile;
+  m_base = 0;
+  m_fd = open(logFile.c_str(), O_RDWR | O_CREAT, 0600);
+  if (m_fd < 0) {
+    cerr << "Could not open replication log " << logFile << endl;
+    exit(1);
+  }
+
+  struct stat info;
+  if (fstat(m_fd, &info) != 0) {
+    perror("ReplicationLog::fstat");
+    exit(1);
+  }
+  string data(info.st_size, '\0');
+  if (pread(m_fd, data.data(), data.size(), 0) != (ssize_t) data.size()) {
+    cerr << "Could not read replication log " << logFile << endl;
+    exit(1);
+  }
+
+  size_t offset = 0;
+  ReplicationRecord record;
+  if (decode(data, offset, record) && record.lsn > 0) {
+    // a truncated log starts part way through
+    m_base = record.lsn - 1;
+  }
+  offset = 0;
+  while (true) {
+    size_t start = offset;
+    if (!decode(data, offset, record) || record.lsn != m_base + m_offsets.size() + 1) {
+      offset = start;
+      break;
+    }
+    m_offsets.push_back(start);
+  }
+  m_end = offset;
+  if (m_end != info.st_size && ftruncate(m_fd, m_end) != 0) {
+    perror("ReplicationLog::ftruncate");
+    exit(1);
+  }
+}
+
+uint64_t ReplicationLog::lastLsn() {
+  dthread_mutex_lock(&m_mutex);
+  uint64_t lsn = m_base + m_offsets.size();
+  dthread_mutex_unlock(&m_mutex);
+  return lsn;
+}
+
+uint64_t ReplicationLog::append(int method, const string &path, const string &body) {
+  dthread_mutex_lock(&m_mutex);
+  ReplicationRecord record = { m_base + m_offsets.size() + 1, method, path, body };
+  write(record);
+  dthread_mutex_unlock(&m_mutex);
+  return record.lsn;
+}
+
+void ReplicationLog::append(const ReplicationRecord &record) {
+  dthread_mutex_lock(&m_mutex);
+  if (record.lsn != m_base + m_offsets.size() + 1) {
+    cerr << "Replication log out of order at " << record.lsn << endl;
+    exit(1);
+  }
+  write(record);
+  dthread_mutex_unlock(&m_mutex);
+}
+
+// with m_mutex held
+void ReplicationLog::write(const ReplicationRecord &record) {
+  string encoded;
+  encode(record, encoded);
+  if (pwrite(m_fd, encoded.data(), encoded.size(), m_end) != (ssize_t) encoded.size()) {
+    cerr << "Could not write replication log" << endl;
+    exit(1);
+  }
+  // the write is acknowledged to clients and backups after this, so it
+  // has to survive a crash like the disk blocks it describes
+  fdatasync(m_fd);
+  m_offsets.push_back(m_end);
+  m_end += encoded.size();
+}
+
+bool ReplicationLog::readAfter(uint64_t lsn, size_t maxBytes, string &batch) {
+  dthread_mutex_lock(&m_mutex);
+  if (lsn < m_base) {
+    dthread_mutex_unlock(&m_mutex);
+    return false;
+  }
+  uint64_t first = lsn - m_base;
+  off_t start = first < m_offsets.size() ? m_offsets[first] : m_end;
+  off_t end = m_end;
+  // m_offsets[next] is where the record after the next'th starts, so
+  // m_offsets[next] - start is the size of a batch that ends with it
+  for (uint64_t next = first + 1; next < m_offsets.size(); next++) {
+    if (m_offsets[next] - start > (off_t) maxBytes) {
+      end = m_offsets[next];
+      break;
+    }
+  }
+
+  // under the lock, since truncate replaces the file
+  batch.assign(end - start, '\0');
+  if (pread(m_fd, batch.data(), batch.size(), start) != (ssize_t) batch.size()) {
+    cerr << "Could not read replication log" << endl;
+    exit(1);
+  }
+  dthread_mutex_unlock(&m_mutex);
+  return true;
+}
+
+void ReplicationLog::truncate(uint64_t lsn) {
+  dthread_mutex_lock(&m_mutex);
+  // keep the newest record, it's what says where the log is
+  uint64_t last = m_base + m_offsets.size();
+  uint64_t dropped = min(lsn, last - min(last, (uint64_t) 1));
+  if (dropped <= m_base || m_offsets[dropped - m_base] < (off_t) REPLICATION_COMPACT_BYTES) {
+    dthread_mutex_unlock(&m_mutex);
+    return;
+  }
+
+  // write what's left to a new file and rename it over the old one, so a
+  // crash leaves one or the other
+  size_t count = dropped - m_base;
+  off_t cut = m_offsets[count];
+  string kept(m_end - cut, '\0');
+  string temporary = m_file + ".tmp";
+  int fd = open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0 ||
+      pread(m_fd, kept.data(), kept.size(), cut) != (ssize_t) kept.size() ||
+      pwrite(fd, kept.data(), kept.size(), 0) != (ssize_t) kept.size() ||
+      fdatasync(fd) != 0 || rename(temporary.c_str(), m_file.c_str()) != 0) {
+    cerr << "Could not truncate replication log " << m_file << endl;
+    exit(1);
+  }
+  close(m_fd);
+  m_fd = fd;
+  m_offsets.erase(m_offsets.begin(), m_offsets.begin() + count);
+  for (size_t idx = 0; idx < m_offsets.size(); idx++) {
+    m_offsets[idx] -= cut;
+  }
+  m_end -= cut;
+  m_base = dropped;
+  dthread_mutex_unlock(&m_mutex);
+}
+
+void ReplicationLog::encode(const ReplicationRecord &record, string &out) {
+  char header[128];
+  snprintf(header, sizeof(header), "%llu %s %zu %zu\n", (unsigned long long) record.lsn,
+           http_method_str((enum http_method) record.method), record.path.size(), record.body.size());
+  out += header;
+  out += record.path;
+  out += record.body;
+}
+
+bool ReplicationLog::decode(const string &data, size_t &offset, ReplicationRecord &record) {
+  size_t newline = data.find('\n', offset);
+  if (newline == string::npos) {
+    return false;
+  }
+  unsigned long long lsn;
+  char method[16];
+  size_t pathLength, bodyLength;
+  string header = data.substr(offset, newline - offset);
+  if (sscanf(header.c_str(), "%llu %15s %zu %zu", &lsn, method, &pathLength, &bodyLength) != 4) {
+    return false;
+  }
+  size_t start = newline + 1;
+  if (pathLength > data.size() - start || bodyLength > data.size() - start - pathLength) {
+    return false;
+  }
+
+  record.lsn = lsn;
+  if (string(method) == "PUT") {
+    record.method = HTTP_PUT;
+  } else if (string(method) == "DELETE") {
+    record.method = HTTP_DELETE;
+  } else if (string(method) == "MOVE") {
+    record.method = HTTP_MOVE;
+  } else if (string(method) == "COPY") {
+    record.method = HTTP_COPY;
+  } else {
+    return false;
+  }
+  record.path = data.substr(start, pathLength);
+  record.body = data.substr(start + pathLength, bodyLength);
+  offset = start + pathLength + bodyLength;
+  return true;
+}
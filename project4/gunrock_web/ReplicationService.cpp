@@ -0,0 +1,148 @@
+#include "ReplicationService.h"
+#include "ClientError.h"
+#include "Metrics.h"
+#include "StringUtils.h"
+#include "dthread.h"
+#include "http_parser.h"
+#include "ufs.h"
+
+#include <iostream>
+
+using namespace std;
+
+ReplicationService::ReplicationService(DistributedFileSystemService *fileSystem, ReplicationLog *log,
+                                       const string &token)
+  : HttpService("/replication/") {
+  m_fileSystem = fileSystem;
+  m_log = log;
+  m_token = token;
+  m_skipped = 0;
+  pthread_mutex_init(&m_applyLock, NULL);
+  Metrics::addCollector([this](string &out) { renderMetrics(out); });
+}
+
+void ReplicationService::authorize(HTTPRequest *request) {
+  if (!request->hasHeader(REPLICATION_TOKEN_HEADER)) {
+    throw ClientError::forbidden();
+  }
+  // compares every byte so the time taken doesn't give the token away
+  string_view token = request->getHeader(REPLICATION_TOKEN_HEADER);
+  if (m_token.empty() || token.size() != m_token.size()) {
+    throw ClientError::forbidden();
+  }
+  unsigned char differ = 0;
+  for (size_t idx = 0; idx < token.size(); idx++) {
+    differ |= token[idx] ^ m_token[idx];
+  }
+  if (differ != 0) {
+    throw ClientError::forbidden();
+  }
+}
+
+void ReplicationService::get(HTTPRequest *request, HTTPResponse *response) {
+  if (request->getPath() != "/replication/lsn") {
+    throw ClientError::notFound();
+  }
+  authorize(request);
+  dthread_mutex_lock(&m_applyLock);
+  string lsn = answer(m_log->lastLsn());
+  dthread_mutex_unlock(&m_applyLock);
+  response->setContentType("text/plain");
+  response->setBody(lsn);
+}
+
+void ReplicationService::post(HTTPRequest *request, HTTPResponse *response) {
+  if (request->getPath() != "/replication/apply") {
+    throw ClientError::notFound();
+  }
+  authorize(request);
+  // room for the record that takes a batch over REPLICATION_BATCH_BYTES
+  BufferedBodySink body(REPLICATION_BATCH_BYTES + MAX_FILE_SIZE + 1024, request->getContentLength());
+  request->readBody(&body);
+  string &batch = body.body();
+
+  dthread_mutex_lock(&m_applyLock);
+  uint64_t last = m_log->lastLsn();
+  size_t offset = 0;
+  bool gap = false;
+  try {
+    ReplicationRecord record;
+    while (offset < batch.size()) {
+      if (!ReplicationLog::decode(batch, offset, record)) {
+        throw ClientError::badRequest();
+      }
+      if (record.lsn <= last) {
+        // already applied, the primary resent it
+        continue;
+      }
+      if (record.lsn != last + 1) {
+        gap = true;
+        break;
+      }
+      try {
+        apply(record);
+      } catch (ClientError &ce) {
+        // it would fail the same way every time the primary resent it
+        m_skipped++;
+        cerr << "replication: skipped " << http_method_str((enum http_method) record.method) << " "
+             << record.path << " at LSN " << record.lsn << ", it failed with " << ce.status_code << endl;
+      }
+      m_log->append(record);
+      last = record.lsn;
+    }
+  } catch (ClientError &) {
+    dthread_mutex_unlock(&m_applyLock);
+    throw;
+  }
+  string applied = answer(last);
+  dthread_mutex_unlock(&m_applyLock);
+
+  // nothing reads a backup's log but its own restart, which only needs
+  // the last LSN
+  m_log->truncate(last);
+
+  if (gap) {
+    response->setStatus(409);
+  }
+  response->setContentType("text/plain");
+  response->setBody(applied);
+}
+
+// with m_applyLock held
+string ReplicationService::answer(uint64_t lsn) {
+  return to_string(lsn) + " " + to_string(m_skipped);
+}
+
+void ReplicationService::renderMetrics(string &out) {
+  dthread_mutex_lock(&m_applyLock);
+  uint64_t skipped = m_skipped;
+  dthread_mutex_unlock(&m_applyLock);
+  out += "# HELP gunrock_replication_skipped_records_total Records from the primary that failed to apply.\n";
+  out += "# TYPE gunrock_replication_skipped_records_total counter\n";
+  out += "gunrock_replication_skipped_records_total " + to_string(skipped) + "\n";
+}
+
+void ReplicationService::apply(const ReplicationRecord &record) {
+  vector<string> path = StringUtils::split(record.path, '/');
+  if (path.empty()) {
+    throw ClientError::badRequest();
+  }
+  if (record.method == HTTP_PUT) {
+    m_fileSystem->putObject(path, record.body);
+    return;
+  }
+  try {
+    if (record.method == HTTP_MOVE) {
+      m_fileSystem->moveObject(path, StringUtils::split(record.body, '/'), true);
+    } else if (record.method == HTTP_COPY) {
+      m_fileSystem->copyObject(path, StringUtils::split(record.body, '/'), true);
+    } else {
+      m_fileSystem->deleteObject(path);
+    }
+  } catch (ClientError &ce) {
+    // we crashed after deleting or moving it but before logging that
+    if (ce.status_code != 404) {
+      throw;
+    }
+  }
+}
@@ -0,0 +1,209 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#include "Replicator.h"
+#include "HttpClient.h"
+#include "Metrics.h"
+#include "dthread.h"
+
+using namespace std;
+
+// how long to wait before trying an unreachable backup again
+static const int RETRY_SECONDS = 2;
+// how long connecting, sending a batch, or waiting for its answer may
+// take before we call the backup down, so one that hangs can't hold up
+// synchronous writes
+static const int EXCHANGE_TIMEOUT_MS = 10000;
+
+Replicator::Replicator(ReplicationLog *log, vector<string> backups, bool synchronous,
+                       const string &token) {
+  m_log = log;
+  m_token = token;
+  m_synchronous = synchronous;
+  pthread_mutex_init(&m_mutex, NULL);
+  pthread_cond_init(&m_logged, NULL);
+  pthread_cond_init(&m_acked, NULL);
+
+  for (size_t idx = 0; idx < backups.size(); idx++) {
+    size_t colon = backups[idx].rfind(':');
+    if (colon == string::npos) {
+      cerr << "backups are host:port, not " << backups[idx] << endl;
+      exit(1);
+    }
+    Backup *backup = new Backup;
+    backup->replicator = this;
+    backup->host = backups[idx].substr(0, colon);
+    backup->port = atoi(backups[idx].c_str() + colon + 1);
+    backup->acked = 0;
+    backup->known = false;
+    backup->up = true;
+    backup->skipped = 0;
+    backup->diverged = false;
+    m_backups.push_back(backup);
+  }
+  for (size_t idx = 0; idx < m_backups.size(); idx++) {
+    dthread_create(&m_backups[idx]->thread, NULL, sendLoop, m_backups[idx]);
+    dthread_detach(m_backups[idx]->thread);
+  }
+
+  Metrics::addCollector([this](string &out) { renderMetrics(out); });
+}
+
+uint64_t Replicator::logged(int method, const string &path, const string &body) {
+  uint64_t lsn = m_log->append(method, path, body);
+  dthread_mutex_lock(&m_mutex);
+  dthread_cond_broadcast(&m_logged);
+  dthread_mutex_unlock(&m_mutex);
+  return lsn;
+}
+
+void Replicator::waitForBackups(uint64_t lsn) {
+  if (!m_synchronous) {
+    return;
+  }
+  dthread_mutex_lock(&m_mutex);
+  while (true) {
+    bool behind = false;
+    for (size_t idx = 0; idx < m_backups.size(); idx++) {
+      Backup *backup = m_backups[idx];
+      behind = behind || (backup->up && (!backup->known || backup->acked < lsn));
+    }
+    if (!behind) {
+      break;
+    }
+    dthread_cond_wait(&m_acked, &m_mutex);
+  }
+  dthread_mutex_unlock(&m_mutex);
+}
+
+void *Replicator::sendLoop(void *arg) {
+  Backup *backup = (Backup *) arg;
+  Replicator *self = backup->replicator;
+  string name = backup->host + ":" + to_string(backup->port);
+  while (true) {
+    dthread_mutex_lock(&self->m_mutex);
+    while (backup->known && backup->acked >= self->m_log->lastLsn()) {
+      dthread_cond_wait(&self->m_logged, &self->m_mutex);
+    }
+    bool known = backup->known;
+    uint64_t acked = backup->acked;
+    dthread_mutex_unlock(&self->m_mutex);
+
+    uint64_t lsn;
+    uint64_t skipped = 0;
+    bool answered;
+    bool truncated = false;
+    if (!known) {
+      answered = self->exchange(backup, "GET", "/replication/lsn", "", lsn, skipped);
+    } else {
+      string batch;
+      if (self->m_log->readAfter(acked, REPLICATION_BATCH_BYTES, batch)) {
+        answered = self->exchange(backup, "POST", "/replication/apply", batch, lsn, skipped);
+      } else {
+        // it went back to before what we kept, say it was restored from
+        // an old image, and can't catch up from the log
+        cerr << "replication to " << name << " needs records after " << acked
+             << " that have been truncated from the log" << endl;
+        answered = false;
+        truncated = true;
+      }
+    }
+
+    dthread_mutex_lock(&self->m_mutex);
+    backup->known = answered;
+    backup->up = answered;
+    if (answered) {
+      backup->acked = lsn;
+      // the count starts again from 0 when the backup restarts
+      if (skipped > backup->skipped) {
+        cerr << "replication to " << name << " diverged, it skipped " << skipped - backup->skipped
+             << " records it couldn't apply" << endl;
+      }
+      backup->skipped = skipped;
+    }
+    backup->diverged = backup->diverged || skipped > 0 || truncated;
+    uint64_t truncateTo = self->minimumAcked();
+    dthread_cond_broadcast(&self->m_acked);
+    dthread_mutex_unlock(&self->m_mutex);
+
+    self->m_log->truncate(truncateTo);
+    if (!answered) {
+      sleep(RETRY_SECONDS);
+    }
+  }
+  return NULL;
+}
+
+uint64_t Replicator::minimumAcked() {
+  // a backup we've never heard from has acked 0, so nothing is dropped
+  // until every backup has answered once
+  uint64_t lowest = UINT64_MAX;
+  for (size_t idx = 0; idx < m_backups.size(); idx++) {
+    lowest = min(lowest, m_backups[idx]->acked);
+  }
+  return lowest;
+}
+
+bool Replicator::exchange(Backup *backup, string method, string path, string body, uint64_t &lsn,
+                          uint64_t &skipped) {
+  HTTPClientResponse *response = NULL;
+  try {
+    HttpClient client(backup->host.c_str(), backup->port, false, EXCHANGE_TIMEOUT_MS);
+    client.set_header(REPLICATION_TOKEN_HEADER, m_token);
+    client.write_request(path, method, body);
+    response = client.read_response();
+  } catch (runtime_error &e) {
+    cerr << "replication to " << backup->host << ":" << backup->port << " failed: " << e.what() << endl;
+    return false;
+  }
+
+  // a backup that is missing records answers 409 with the LSN it does
+  // have, which is where we carry on from
+  int status = response->status();
+  string answer = response->body();
+  delete response;
+  if (status != 200 && status != 409) {
+    cerr << "replication to " << backup->host << ":" << backup->port << " failed with " << status << endl;
+    return false;
+  }
+  // "<lsn> <skipped>"
+  char *end;
+  lsn = strtoull(answer.c_str(), &end, 10);
+  skipped = strtoull(end, NULL, 10);
+  return true;
+}
+
+void Replicator::renderMetrics(string &out) {
+  uint64_t last = m_log->lastLsn();
+  out += "# HELP gunrock_replication_lsn Last LSN in the replication log.\n";
+  out += "# TYPE gunrock_replication_lsn gauge\n";
+  out += "gunrock_replication_lsn " + to_string(last) + "\n";
+  dthread_mutex_lock(&m_mutex);
+  out += "# HELP gunrock_replication_lag_records Logged records a backup hasn't applied yet.\n";
+  out += "# TYPE gunrock_replication_lag_records gauge\n";
+  for (size_t idx = 0; idx < m_backups.size(); idx++) {
+    Backup *backup = m_backups[idx];
+    out += "gunrock_replication_lag_records{backup=\"" + backup->host + ":" + to_string(backup->port)
+      + "\"} " + to_string(last - min(last, backup->acked)) + "\n";
+  }
+  out += "# HELP gunrock_replication_backup_diverged Whether a backup skipped records or fell behind the log.\n";
+  out += "# TYPE gunrock_replication_backup_diverged gauge\n";
+  for (size_t idx = 0; idx < m_backups.size(); idx++) {
+    Backup *backup = m_backups[idx];
+    out += "gunrock_replication_backup_diverged{backup=\"" + backup->host + ":" + to_string(backup->port)
+      + "\"} " + (backup->diverged ? "1" : "0") + "\n";
+  }
+  out += "# HELP gunrock_replication_backup_up Whether the last exchange with a backup worked.\n";
+  out += "# TYPE gunrock_replication_backup_up gauge\n";
+  for (size_t idx = 0; idx < m_backups.size(); idx++) {
+    Backup *backup = m_backups[idx];
+    out += "gunrock_replication_backup_up{backup=\"" + backup->host + ":" + to_string(backup->port)
+      + "\"} " + (backup->up ? "1" : "0") + "\n";
+  }
+  dthread_mutex_unlock(&m_mutex);
+}
@@ -0,0 +1,83 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "RequestArena.h"
+
+using namespace std;
+
+// blocks beyond this much total are returned to malloc on reset so one
+// huge request doesn't pin memory on its thread forever
+#define MAX_RETAINED_BYTES (256 * 1024)
+
+RequestArena::RequestArena(size_t blockSize) {
+  m_blockSize = blockSize;
+  m_current = 0;
+  m_offset = 0;
+  m_bytesAllocated = 0;
+}
+
+RequestArena::~RequestArena() {
+  for (unsigned int idx = 0; idx < m_blocks.size(); idx++) {
+    free(m_blocks[idx].data);
+  }
+}
+
+RequestArena *RequestArena::threadArena() {
+  static thread_local RequestArena arena;
+  return &arena;
+}
+
+void *RequestArena::do_allocate(size_t bytes, size_t alignment) {
+  while (true) {
+    if (m_current == m_blocks.size()) {
+      // out of blocks, add one big enough for this allocation
+      Block block;
+      block.size = m_blockSize;
+      while (block.size < bytes + alignment) {
+        block.size *= 2;
+      }
+      block.data = (char *) malloc(block.size);
+      if (block.data == NULL) {
+        throw bad_alloc();
+      }
+      m_blocks.push_back(block);
+    }
+
+    Block &block = m_blocks[m_current];
+    uintptr_t base = (uintptr_t) block.data;
+    size_t start = ((base + m_offset + alignment - 1) & ~((uintptr_t) alignment - 1)) - base;
+    if (start + bytes <= block.size) {
+      m_offset = start + bytes;
+      m_bytesAllocated += bytes;
+      return block.data + start;
+    }
+
+    m_current++;
+    m_offset = 0;
+  }
+}
+
+void RequestArena::do_deallocate(void *p, size_t bytes, size_t alignment) {
+  // memory is reclaimed all at once by reset
+}
+
+bool RequestArena::do_is_equal(const std::pmr::memory_resource &other) const noexcept {
+  return this == &other;
+}
+
+void RequestArena::reset() {
+  size_t retained = 0;
+  unsigned int keep = 0;
+  while (keep < m_blocks.size() && retained + m_blocks[keep].size <= MAX_RETAINED_BYTES) {
+    retained += m_blocks[keep].size;
+    keep++;
+  }
+  for (unsigned int idx = keep; idx < m_blocks.size(); idx++) {
+    free(m_blocks[idx].data);
+  }
+  m_blocks.resize(keep);
+
+  m_current = 0;
+  m_offset = 0;
+  m_bytesAllocated = 0;
+}
@@ -0,0 +1,117 @@
+#include <algorithm>
+
+#include "ServiceRouter.h"
+
+using namespace std;
+
+ServiceRouter::Handler ServiceRouter::s_handlers[HTTP_MERGE + 1] = {
+  &HttpService::del,   // HTTP_DELETE
+  &HttpService::get,   // HTTP_GET
+  &HttpService::head,  // HTTP_HEAD
+  &HttpService::post,  // HTTP_POST
+  &HttpService::put,   // HTTP_PUT
+  NULL,                // HTTP_CONNECT
+  NULL,                // HTTP_OPTIONS
+  NULL,                // HTTP_TRACE
+  &HttpService::copy,  // HTTP_COPY
+  NULL,                // HTTP_LOCK
+  NULL,                // HTTP_MKCOL
+  &HttpService::move,  // HTTP_MOVE
+};
+
+ServiceRouter::ServiceRouter() {
+  m_root = new Node;
+  m_root->service = NULL;
+}
+
+ServiceRouter::~ServiceRouter() {
+  freeNode(m_root);
+}
+
+void ServiceRouter::freeNode(Node *node) {
+  for (size_t idx = 0; idx < node->children.size(); idx++) {
+    freeNode(node->children[idx]);
+  }
+  delete node;
+}
+
+ServiceRouter::Node *ServiceRouter::findChild(Node *node, char first) {
+  vector<Node *>::iterator iter =
+    lower_bound(node->children.begin(), node->children.end(), first,
+                [](Node *child, char c) { return child->label[0] < c; });
+  if (iter != node->children.end() && (*iter)->label[0] == first) {
+    return *iter;
+  }
+  return NULL;
+}
+
+void ServiceRouter::mount(HttpService *service) {
+  string prefix = service->pathPrefix();
+  Node *node = m_root;
+  size_t pos = 0;
+
+  while (pos < prefix.size()) {
+    Node *child = findChild(node, prefix[pos]);
+    if (child == NULL) {
+      // nothing shares this byte, hang the rest of the prefix off node
+      Node *leaf = new Node;
+      leaf->label = prefix.substr(pos);
+      leaf->service = service;
+      vector<Node *>::iterator iter =
+        lower_bound(node->children.begin(), node->children.end(), leaf->label[0],
+                    [](Node *n, char c) { return n->label[0] < c; });
+      node->children.insert(iter, leaf);
+      return;
+    }
+
+    // length of the label the prefix shares with this edge
+    size_t common = 0;
+    while (common < child->label.size() && pos + common < prefix.size() &&
+           child->label[common] == prefix[pos + common]) {
+      common++;
+    }
+
+    if (common < child->label.size()) {
+      // split the edge so the shared part becomes its own node
+      Node *split = new Node;
+      split->label = child->label.substr(0, common);
+      split->service = NULL;
+      child->label = child->label.substr(common);
+      split->children.push_back(child);
+      *find(node->children.begin(), node->children.end(), child) = split;
+      child = split;
+    }
+
+    node = child;
+    pos += common;
+  }
+
+  node->service = service;
+}
+
+HttpService *ServiceRouter::route(string_view path) {
+  Node *node = m_root;
+  HttpService *match = node->service;
+  size_t pos = 0;
+
+  while (pos < path.size()) {
+    Node *child = findChild(node, path[pos]);
+    if (child == NULL || path.compare(pos, child->label.size(), child->label) != 0) {
+      break;
+    }
+    node = child;
+    pos += child->label.size();
+    if (node->service != NULL) {
+      match = node->service;
+    }
+  }
+
+  return match;
+}
+
+ServiceRouter::Handler ServiceRouter::handler(int method) {
+  if (method < 0 || method > HTTP_MERGE) {
+    return NULL;
+  }
+  return s_handlers[method];
+}
@@ -0,0 +1,37 @@
+#include <iostream>
+#include <string>
+#include <memory>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+int main(int argc, char *argv[])
+{
+  if (argc != 5)
+  {
+    cerr << argv[0] << ": diskImageFile srcInode dstParentInode dstName" << endl;
+    cerr << "For example:" << endl;
+    cerr << "    $ " << argv[0] << " a.img 3 2 copy.txt" << endl;
+    return 1;
+  }
+
+  unique_ptr<Disk> disk = make_unique<Disk>(argv[1], UFS_BLOCK_SIZE);
+  unique_ptr<LocalFileSystem> fileSystem = make_unique<LocalFileSystem>(disk.get());
+  int srcInode = stoi(argv[2]);
+  int dstParentInode = stoi(argv[3]);
+  string dstName = string(argv[4]);
+
+  // the copy shares the source's data blocks until one of them is written
+  disk->beginTransaction();
+  if (fileSystem->copy(srcInode, dstParentInode, dstName) < 0)
+  {
+    disk->rollback();
+    cerr << "Error copying file" << endl;
+    return 1;
+  }
+  disk->commit();
+  return 0;
+}
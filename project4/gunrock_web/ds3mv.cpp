@@ -0,0 +1,45 @@
+#include <iostream>
+#include <string>
+#include <memory>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+int main(int argc, char *argv[])
+{
+  if (argc != 6)
+  {
+    cerr << argv[0] << ": diskImageFile srcParentInode srcName dstParentInode dstName" << endl;
+    cerr << "For example:" << endl;
+    cerr << "    $ " << argv[0] << " a.img 1 b 0 b" << endl;
+    return 1;
+  }
+
+  unique_ptr<Disk> disk = make_unique<Disk>(argv[1], UFS_BLOCK_SIZE);
+  unique_ptr<LocalFileSystem> fileSystem = make_unique<LocalFileSystem>(disk.get());
+  int srcParentInode = stoi(argv[2]);
+  string srcName = string(argv[3]);
+  int dstParentInode = stoi(argv[4]);
+  string dstName = string(argv[5]);
+
+  disk->beginTransaction();
+  int ret = fileSystem->rename(srcParentInode, srcName, dstParentInode, dstName);
+  if (ret < 0)
+  {
+    disk->rollback();
+    if (ret == -EINVALIDMOVE)
+    {
+      cerr << "Error moving a directory into itself" << endl;
+    }
+    else
+    {
+      cerr << "Error moving entry" << endl;
+    }
+    return 1;
+  }
+  disk->commit();
+  return 0;
+}
@@ -2,14 +2,241 @@
 #include <iostream>
 #include <string>
 #include <vector>
-#include <sstream>
+
+#include <atomic>
 
 #include <fcntl.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
-std::vector<pthread_t> thread_list;
+// Log lines are formatted by the calling thread into its own ring buffer
+// and written out in batches by a background flusher, so logging never
+// takes a lock or makes a syscall on the request path. Every line gets a
+// number from a global counter when it is logged and the flusher writes
+// lines in that order, so the file reads exactly as if every thread had
+// written under one lock.
+//
+// The flusher sleeps on a condition variable while the next line isn't
+// in any ring, and a logging thread only signals it when it is asleep.
+// A thread whose ring is full sleeps the same way until the flusher has
+// made room. SIGINT and SIGTERM drain whatever is buffered before the
+// process dies.
+
+#define LOG_RING_SLOTS (1024)
+#define LOG_INLINE_BYTES (232)
+#define MAX_LOG_THREADS (1024)
+#define LOG_BATCH_BYTES (64 * 1024)
+
+struct LogRecord {
+  uint64_t seq;
+  uint32_t length;
+  char text[LOG_INLINE_BYTES];
+  // lines that don't fit inline, owned by the record
+  char *overflow;
+};
+
+// single producer (the owning thread), single consumer (the flusher)
+struct LogRing {
+  std::atomic<uint64_t> head;
+  std::atomic<uint64_t> tail;
+  LogRecord records[LOG_RING_SLOTS];
+};
+
 int logFd = -1;
+static std::atomic<uint64_t> nextLogSeq(0);
+static std::atomic<int> numLogRings(0);
+static std::atomic<LogRing *> logRings[MAX_LOG_THREADS];
+static thread_local LogRing *myRing = NULL;
+static thread_local int myTid = -1;
+static pthread_once_t flusherOnce = PTHREAD_ONCE_INIT;
+static pthread_t flusherThread;
+static std::atomic<bool> flusherStop(false);
+// plain pthread calls, the flusher and the loggers can't log themselves
+static pthread_mutex_t flusherLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusherWake = PTHREAD_COND_INITIALIZER;
+static std::atomic<bool> flusherSleeping(false);
+// loggers waiting for room in their ring, under flusherLock
+static pthread_cond_t logSpace = PTHREAD_COND_INITIALIZER;
+static std::atomic<int> logSpaceWaiters(0);
+// posted by the handler for SIGINT and SIGTERM, which can't do the
+// draining itself
+static sem_t logSignalled;
+static volatile sig_atomic_t logSignal = 0;
+
+static void write_log_batch(std::string &batch) {
+  ssize_t ret = write(logFd, batch.c_str(), batch.length());
+  if (ret >= 0 && (size_t) ret != batch.length()) {
+    std::cerr << "log file write error, ret = " << ret << " expected " << batch.length() << std::endl;
+    exit(1);
+  }
+  batch.clear();
+}
+
+// writes out every record whose turn it is, returns true if it wrote any
+static bool drain_log_rings(std::string &batch, uint64_t &expected) {
+  bool progressed = false;
+  bool found = true;
+  while (found) {
+    found = false;
+    int rings = numLogRings.load(std::memory_order_acquire);
+    for (int idx = 0; idx < rings; idx++) {
+      LogRing *ring = logRings[idx].load(std::memory_order_acquire);
+      if (ring == NULL) {
+        continue;
+      }
+      uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+      uint64_t head = ring->head.load(std::memory_order_acquire);
+      // a thread's records are in order, so take a run of them at once
+      while (tail < head) {
+        LogRecord *record = &ring->records[tail % LOG_RING_SLOTS];
+        if (record->seq != expected) {
+          break;
+        }
+        if (record->overflow != NULL) {
+          batch.append(record->overflow, record->length);
+          delete [] record->overflow;
+          record->overflow = NULL;
+        } else {
+          batch.append(record->text, record->length);
+        }
+        tail++;
+        expected++;
+        found = true;
+      }
+      ring->tail.store(tail);
+      if (batch.size() >= LOG_BATCH_BYTES) {
+        write_log_batch(batch);
+      }
+    }
+    progressed = progressed || found;
+  }
+  // a logger checks its tail after counting itself as a waiter, and we
+  // check for waiters after moving the tails, so one of us sees the other
+  if (progressed && logSpaceWaiters.load() > 0) {
+    pthread_mutex_lock(&flusherLock);
+    pthread_cond_broadcast(&logSpace);
+    pthread_mutex_unlock(&flusherLock);
+  }
+  return progressed;
+}
+
+// whether the line numbered expected is sitting at the tail of a ring
+static bool next_log_record_ready(uint64_t expected) {
+  int rings = numLogRings.load(std::memory_order_acquire);
+  for (int idx = 0; idx < rings; idx++) {
+    LogRing *ring = logRings[idx].load(std::memory_order_acquire);
+    if (ring == NULL) {
+      continue;
+    }
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    if (tail < ring->head.load() && ring->records[tail % LOG_RING_SLOTS].seq == expected) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void *log_flusher(void *arg) {
+  std::string batch;
+  uint64_t expected = 0;
+  batch.reserve(LOG_BATCH_BYTES * 2);
+
+  while (true) {
+    bool stopping = flusherStop.load(std::memory_order_acquire);
+    bool progressed = drain_log_rings(batch, expected);
+    if (!batch.empty()) {
+      write_log_batch(batch);
+    }
+    // at exit, stop once everything that was logged has been written, or
+    // when a thread that died mid-line leaves a gap we can never fill
+    if (stopping && (expected == nextLogSeq.load(std::memory_order_acquire) || !progressed)) {
+      break;
+    }
+    if (progressed) {
+      continue;
+    }
+
+    // the next line hasn't been logged, or has its number but isn't in
+    // its ring yet, so sleep until a logger publishes one. A logger
+    // checks flusherSleeping after publishing its line, and we look for
+    // the line after setting it, so one of us always sees the other.
+    pthread_mutex_lock(&flusherLock);
+    flusherSleeping.store(true);
+    if (!next_log_record_ready(expected) && !flusherStop.load()) {
+      pthread_cond_wait(&flusherWake, &flusherLock);
+    }
+    flusherSleeping.store(false);
+    pthread_mutex_unlock(&flusherLock);
+  }
+  return NULL;
+}
+
+static void wake_log_flusher() {
+  pthread_mutex_lock(&flusherLock);
+  pthread_cond_signal(&flusherWake);
+  pthread_mutex_unlock(&flusherLock);
+}
+
+static void stop_log_flusher() {
+  static pthread_once_t stopOnce = PTHREAD_ONCE_INIT;
+  pthread_once(&stopOnce, [] {
+    flusherStop.store(true);
+    wake_log_flusher();
+    pthread_join(flusherThread, NULL);
+  });
+}
+
+static void log_signal_handler(int signum) {
+  logSignal = signum;
+  sem_post(&logSignalled);
+}
+
+// waits for SIGINT or SIGTERM, writes out the buffered lines, then lets
+// the signal kill the process the way it would have
+static void *log_signal_waiter(void *arg) {
+  while (sem_wait(&logSignalled) != 0) {
+  }
+  int signum = logSignal;
+  stop_log_flusher();
+  signal(signum, SIG_DFL);
+  raise(signum);
+  return NULL;
+}
+
+static void drain_log_on_signals() {
+  sem_init(&logSignalled, 0, 0);
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = log_signal_handler;
+  sigemptyset(&action.sa_mask);
+  int signals[] = { SIGINT, SIGTERM };
+  for (size_t idx = 0; idx < sizeof(signals) / sizeof(signals[0]); idx++) {
+    struct sigaction current;
+    // leave alone a signal the program handles or ignores itself
+    if (sigaction(signals[idx], NULL, &current) == 0 && current.sa_handler == SIG_DFL) {
+      sigaction(signals[idx], &action, NULL);
+    }
+  }
+  pthread_t waiter;
+  if (pthread_create(&waiter, NULL, log_signal_waiter, NULL) == 0) {
+    pthread_detach(waiter);
+  }
+}
+
+static void start_log_flusher() {
+  // not a dthread, the flusher must never log itself
+  if (pthread_create(&flusherThread, NULL, log_flusher, NULL) != 0) {
+    std::cerr << "could not start the log flusher" << std::endl;
+    exit(1);
+  }
+  atexit(stop_log_flusher);
+  drain_log_on_signals();
+}
 
 void set_log_file(std::string file_name) {
   logFd = open(file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
@@ -17,50 +244,125 @@ void set_log_file(std::string file_name) {
     std::cerr << "Could not open log file: " << file_name << std::endl;
     exit(1);
   }
+  pthread_once(&flusherOnce, start_log_flusher);
 }
 
-void sync_print(std::string function, std::string payload) {
-  int ret = pthread_mutex_lock(&print_lock);
-  if (ret != 0) {
-    std::cerr << "pthread lock mutex error!" << std::endl;
+static void create_log_ring() {
+  // thread ids are handed out in the order threads first log
+  pthread_once(&flusherOnce, start_log_flusher);
+  myTid = numLogRings.load(std::memory_order_relaxed);
+  while (!numLogRings.compare_exchange_weak(myTid, myTid + 1)) {
+  }
+  if (myTid >= MAX_LOG_THREADS) {
+    std::cerr << "too many logging threads" << std::endl;
     exit(1);
   }
+  myRing = new LogRing;
+  myRing->head.store(0);
+  myRing->tail.store(0);
+  for (int idx = 0; idx < LOG_RING_SLOTS; idx++) {
+    myRing->records[idx].overflow = NULL;
+  }
+  logRings[myTid].store(myRing, std::memory_order_release);
+}
 
-  // search through our thread list to find this thread
-  pthread_t self = pthread_self();
-  int tid = -1;
-  for (size_t idx = 0; idx < thread_list.size(); idx++) {
-    if (pthread_equal(self, thread_list[idx])) {
-      tid = idx;
-      break;
+// Returns where a line of length bytes goes in the next free record of
+// this thread's ring, waiting for the flusher rather than dropping lines
+// because the traces must be complete.
+static char *start_log_record(size_t length) {
+  if (myRing == NULL) {
+    create_log_ring();
+  }
+
+  uint64_t head = myRing->head.load(std::memory_order_relaxed);
+  if (head - myRing->tail.load() >= LOG_RING_SLOTS) {
+    pthread_mutex_lock(&flusherLock);
+    logSpaceWaiters.fetch_add(1);
+    while (head - myRing->tail.load() >= LOG_RING_SLOTS) {
+      pthread_cond_wait(&logSpace, &flusherLock);
     }
+    logSpaceWaiters.fetch_sub(1);
+    pthread_mutex_unlock(&flusherLock);
   }
 
-  // if we don't find self in our thread list, add it
-  if (tid < 0) {
-    tid = thread_list.size();
-    thread_list.push_back(self);
+  LogRecord *record = &myRing->records[head % LOG_RING_SLOTS];
+  record->length = length;
+  if (length > LOG_INLINE_BYTES) {
+    record->overflow = new char[length];
+    return record->overflow;
   }
+  return record->text;
+}
 
-  std::stringstream write_stream;
-  write_stream << function << " thread: " << tid << " " << payload << std::endl;
-  std::string write_buffer = write_stream.str();
-  ret = write(logFd, write_buffer.c_str(), write_buffer.length());
-  if (ret >= 0 && (size_t) ret != write_buffer.length()) {
-    std::cerr << "log file write error, ret = " << ret << " expected " << write_buffer.length() << std::endl;
-    exit(1);
+// numbers the record start_log_record filled in and hands it to the flusher
+static void finish_log_record() {
+  uint64_t head = myRing->head.load(std::memory_order_relaxed);
+  myRing->records[head % LOG_RING_SLOTS].seq = nextLogSeq.fetch_add(1);
+  myRing->head.store(head + 1);
+  if (flusherSleeping.load()) {
+    wake_log_flusher();
   }
-  ret = pthread_mutex_unlock(&print_lock);
-  if (ret != 0) {
-    std::cerr << "pthread mutex unlock error!" << std::endl;
-    exit(1);
+}
+
+// writes "function thread: tid" and returns the position after it
+static char *log_line_prefix(char *pos, const char *function, size_t functionLength,
+                             const char *tid, int tidLength) {
+  memcpy(pos, function, functionLength);
+  pos += functionLength;
+  memcpy(pos, " thread: ", 9);
+  pos += 9;
+  memcpy(pos, tid, tidLength);
+  return pos + tidLength;
+}
+
+void sync_print(std::string function, std::string payload) {
+  if (myRing == NULL) {
+    create_log_ring();
+  }
+  char tid[16];
+  int tidLength = snprintf(tid, sizeof(tid), "%d", myTid);
+  size_t length = function.size() + 9 + tidLength + 1 + payload.size() + 1;
+
+  // function thread: tid payload
+  char *pos = start_log_record(length);
+  pos = log_line_prefix(pos, function.data(), function.size(), tid, tidLength);
+  *pos++ = ' ';
+  memcpy(pos, payload.data(), payload.size());
+  pos += payload.size();
+  *pos++ = '\n';
+  finish_log_record();
+}
+
+// the way an ostream prints a pointer, so the traces read as they did
+static int format_log_pointer(char *out, size_t size, const void *ptr) {
+  if (ptr == NULL) {
+    return snprintf(out, size, "0");
   }
+  return snprintf(out, size, "0x%lx", (unsigned long) (uintptr_t) ptr);
 }
 
-void sync_print_thread(std::string function, pthread_mutex_t *mutex, pthread_cond_t *cond) {
-  std::stringstream payload;
-  payload << " mutex: " << (void *) mutex << " cond: " << (void *) cond;
-  sync_print(function, payload.str());
+// The dthread wrappers log twice per call on the locking paths, so
+// their lines are formatted straight into the ring record.
+void sync_print_thread(const char *function, pthread_mutex_t *mutex, pthread_cond_t *cond) {
+  if (myRing == NULL) {
+    create_log_ring();
+  }
+  char tid[16];
+  int tidLength = snprintf(tid, sizeof(tid), "%d", myTid);
+  char pointers[64];
+  char mutexText[24];
+  char condText[24];
+  format_log_pointer(mutexText, sizeof(mutexText), mutex);
+  format_log_pointer(condText, sizeof(condText), cond);
+  int pointersLength = snprintf(pointers, sizeof(pointers), "  mutex: %s cond: %s\n", mutexText, condText);
+  size_t functionLength = strlen(function);
+  size_t length = functionLength + 9 + tidLength + pointersLength;
+
+  // function thread: tid  mutex: m cond: c
+  char *pos = start_log_record(length);
+  pos = log_line_prefix(pos, function, functionLength, tid, tidLength);
+  memcpy(pos, pointers, pointersLength);
+  finish_log_record();
 }
 
 struct DthreadArgs {
@@ -1,8 +1,12 @@
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
 #include <assert.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <math.h>
 
 #include <iostream>
 #include <memory>
@@ -21,6 +25,13 @@
 #include "MySocket.h"
 #include "MyServerSocket.h"
 #include "dthread.h"
+#include "RequestArena.h"
+#include "ServiceRouter.h"
+#include "Metrics.h"
+#include "MetricsService.h"
+#include "ReplicationLog.h"
+#include "ReplicationService.h"
+#include "Replicator.h"
 
 using namespace std;
 int PORT = 8080;
@@ -29,45 +40,83 @@ int BUFFER_SIZE = 1;
 string BASEDIR = "ds3";
 string SCHEDALG = "FIFO";
 string LOGFILE = "/dev/null";
-string DISKFILE = "disk.img";
+vector<string> DISKFILES;
+int ACCEPTORS = 1;
+int LISTEN_BACKLOG = SOMAXCONN;
+int DEFER_ACCEPT = 0;
+int FAST_OPEN = 0;
+string OVERLOAD = "block";
+int RETRY_AFTER = 1;
+vector<string> BACKUPS;
+string ACK_MODE = "sync";
+bool BACKUP_MODE = false;
+string REPLICATION_TOKEN;
+long CACHE_BYTES = 8 * 1024 * 1024;
 
-vector<HttpService *> services;
+// longest the acceptor waits to hand a shed client its 503
+static const int SHED_SEND_TIMEOUT_MS = 10;
 
-HttpService *find_service(HTTPRequest *request) {
-   // find a service that is registered for this path prefix
-  for (unsigned int idx = 0; idx < services.size(); idx++) {
-    if (request->getPath().find(services[idx]->pathPrefix()) == 0) {
-      return services[idx];
-    }
-  }
+ServiceRouter router;
 
-  return NULL;
+// Each listening socket gets its own accept thread and a group of workers
+// fed through a bounded buffer. With more than one acceptor the listeners
+// share the port with SO_REUSEPORT and each group is pinned to one CPU so
+// a connection is accepted and served on the same core.
+struct QueuedClient {
+  MySocket *client;
+  // Metrics::now() when it was accepted, for the queue wait histogram
+  uint64_t acceptedAt;
+};
+
+struct WorkerGroup {
+  MyServerSocket *server;
+  int cpu;
+  deque<QueuedClient> clients;
+  pthread_mutex_t lock;
+  pthread_cond_t notEmpty;
+  pthread_cond_t notFull;
+  // CoDel state, see codel_should_shed
+  uint64_t firstAboveTime;
+  uint64_t dropNext;
+  unsigned long dropCount;
+  bool dropping;
+  unsigned long shed;
+};
+
+// What the acceptor does when a group's buffer is full:
+//   block        wait for a worker to free a slot (the default)
+//   reject       answer the new connection with a 503
+//   drop-oldest  answer the longest waiting connection with a 503 and
+//                queue the new one in its place
+//   codel        reject when full, and have workers shed connections
+//                whenever the queue delay stays above CODEL_TARGET for
+//                a whole CODEL_INTERVAL
+enum OverloadPolicy { OVERLOAD_BLOCK, OVERLOAD_REJECT, OVERLOAD_DROP_OLDEST, OVERLOAD_CODEL };
+OverloadPolicy overloadPolicy = OVERLOAD_BLOCK;
+
+#define CODEL_TARGET (5 * 1000000ULL)
+#define CODEL_INTERVAL (100 * 1000000ULL)
+
+vector<WorkerGroup *> groups;
+
+HttpService *find_service(HTTPRequest *request) {
+  // the service mounted at the longest prefix of this path
+  return router.route(request->getPathView());
 }
 
 
 void invoke_service_method(HttpService *service, HTTPRequest *request, HTTPResponse *response) {
-  stringstream payload;
-
   try {
+    ServiceRouter::Handler handler = ServiceRouter::handler(request->getMethod());
     // invoke the service if we found one
     if (service == NULL) {
       // not found status
       response->setStatus(404);
-    } else if (request->isHead()) {
-      service->head(request, response);
-    } else if (request->isGet()) {
-      service->get(request, response);
-    } else if (request->isPut()) {
-      service->put(request, response);
-    } else if (request->isPost()) {
-      service->post(request, response);
-    } else if (request->isDelete()) {
-      service->del(request, response);
-    } else if (request->isMove()) {
-      service->move(request, response);
-    } else {
+    } else if (handler == NULL) {
       // The server doesn't know about this method
       response->setStatus(501);
+    } else {
+      (service->*handler)(request, response);
     }
   } catch (ClientError &ce) {
     response->setStatus(ce.status_code);
@@ -78,10 +127,53 @@ void invoke_service_method(HttpService *service, HTTPRequest *request, HTTPRespo
   }
 }
 
-void handle_request(MySocket *client) {
-  HTTPRequest *request = new HTTPRequest(client, PORT);
-  HTTPResponse *response = new HTTPResponse();
+void close_client(MySocket *client) {
   stringstream payload;
+  payload << " client: " << (void *) client;
+  sync_print("close_connection", payload.str());
+  client->close();
+  delete client;
+  Metrics::connectionClosed();
+}
+
+// Answers a connection we won't serve with a 503 without reading the
+// request, so it costs next to nothing under load. This runs on the
+// acceptor, so the 503 is best effort: a client that won't take it
+// within SHED_SEND_TIMEOUT_MS just gets closed.
+void shed_client(MySocket *client) {
+  HTTPResponse response(client);
+  response.setStatus(503);
+  response.setHeader("Retry-After", to_string(RETRY_AFTER));
+  response.setHeader("Connection", "close");
+  try {
+    client->setSendTimeout(SHED_SEND_TIMEOUT_MS);
+    response.send();
+    // take whatever request bytes already arrived so closing doesn't
+    // reset the connection before the client reads the 503
+    char drain[4096];
+    while (client->recv(drain, sizeof(drain), MSG_DONTWAIT) > 0) {
+    }
+  } catch (...) {
+    // nothing more to say to this client
+  }
+  close_client(client);
+}
+
+void handle_request(MySocket *client, uint64_t acceptedAt) {
+  uint64_t started = Metrics::now();
+  // everything for this request comes from the thread's arena and is
+  // released in one shot when we're done
+  RequestArena *arena = RequestArena::threadArena();
+  HTTPRequest *request = resourceNew<HTTPRequest>(arena, client, PORT, arena);
+  HTTPResponse *response = resourceNew<HTTPResponse>(arena, client, arena);
+  stringstream payload;
+
+  // a client that stops reading its response can't hold the worker
+  try {
+    client->setSendTimeout(HTTPRequest::limits.sendTimeout);
+  } catch (...) {
+    // the writes will fail on their own
+  }
   
   // read in the request
   bool readResult = false;
@@ -90,36 +182,223 @@ void handle_request(MySocket *client) {
     sync_print("read_request_enter", payload.str());
     readResult = request->readRequest();
     sync_print("read_request_return", payload.str());
+  } catch (ClientError &ce) {
+    // malformed, oversized or too slow, tell the client before hanging up
+    response->setStatus(ce.status_code);
+    response->setHeader("Connection", "close");
+    try {
+      response->send();
+    } catch (...) {
+      // swallow it
+    }
   } catch (...) {
     // swallow it
   }    
     
   if (!readResult) {
     // there was a problem reading in the request, bail
-    delete response;
-    delete request;
+    resourceDelete(arena, response);
+    resourceDelete(arena, request);
+    arena->reset();
     sync_print("read_request_error", payload.str());
+    close_client(client);
     return;
   }
+  uint64_t parsed = Metrics::now();
   
+  if (request->isHead()) {
+    response->withoutBody();
+  }
+
   HttpService *service = find_service(request);
   invoke_service_method(service, request, response);
 
+  // don't bother draining a body we refused because of its size
+  if (response->getStatus() != 413) {
+    try {
+      request->discardBody();
+    } catch (...) {
+      // swallow it
+    }
+  }
+
+  uint64_t served = Metrics::now();
+
   // send data back to the client and clean up
   payload.str(""); payload.clear();
   payload << " RESPONSE " << response->getStatus() << " client: " << (void *) client;
   sync_print("write_response", payload.str());
-  cout << payload.str() << endl;
-  client->write(response->response());
+  try {
+    if (response->isStreaming()) {
+      // the service already pushed the headers and body chunks
+      response->endStream();
+    } else {
+      response->send();
+    }
+  } catch (...) {
+    // the client went away, nothing left to do but clean up
+  }
+  uint64_t written = Metrics::now();
+
+  int route = Metrics::routeId(service);
+  int method = request->getMethod();
+  Metrics::observe(route, method, PHASE_QUEUE, started - acceptedAt);
+  Metrics::observe(route, method, PHASE_PARSE, parsed - started);
+  Metrics::observe(route, method, PHASE_SERVICE, served - parsed);
+  Metrics::observe(route, method, PHASE_WRITE, written - served);
+  Metrics::countResponse(route, method, response->getStatus(),
+                         client->bytesRead(), client->bytesWritten());
     
-  delete response;
-  delete request;
+  resourceDelete(arena, response);
+  resourceDelete(arena, request);
+  arena->reset();
 
-  payload.str(""); payload.clear();
-  payload << " client: " << (void *) client;
-  sync_print("close_connection", payload.str());
-  client->close();
-  delete client;
+  close_client(client);
+}
+
+// accepted connections still waiting in the groups' buffers
+void render_queue_depth(string &out) {
+  size_t depth = 0;
+  for (size_t idx = 0; idx < groups.size(); idx++) {
+    dthread_mutex_lock(&groups[idx]->lock);
+    depth += groups[idx]->clients.size();
+    dthread_mutex_unlock(&groups[idx]->lock);
+  }
+  out += "# HELP gunrock_queue_depth Accepted connections waiting for a worker.\n";
+  out += "# TYPE gunrock_queue_depth gauge\n";
+  out += "gunrock_queue_depth " + to_string(depth) + "\n";
+}
+
+void render_shed(string &out) {
+  unsigned long shed = 0;
+  for (size_t idx = 0; idx < groups.size(); idx++) {
+    dthread_mutex_lock(&groups[idx]->lock);
+    shed += groups[idx]->shed;
+    dthread_mutex_unlock(&groups[idx]->lock);
+  }
+  out += "# HELP gunrock_shed_connections_total Connections answered with 503 by the overload policy.\n";
+  out += "# TYPE gunrock_shed_connections_total counter\n";
+  out += "gunrock_shed_connections_total " + to_string(shed) + "\n";
+}
+
+void pin_to_cpu(int cpu) {
+  if (cpu < 0) {
+    return;
+  }
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+    cerr << "could not pin thread to cpu " << cpu << endl;
+  }
+}
+
+// CoDel on the queue wait of the connection just taken off the queue.
+// Called with the group lock held.
+bool codel_should_shed(WorkerGroup *group, uint64_t now, uint64_t acceptedAt) {
+  if (now - acceptedAt < CODEL_TARGET || group->clients.empty()) {
+    // the queue is draining fine, leave the dropping state
+    group->firstAboveTime = 0;
+    group->dropping = false;
+    return false;
+  }
+  if (group->firstAboveTime == 0) {
+    group->firstAboveTime = now + CODEL_INTERVAL;
+    return false;
+  }
+  if (!group->dropping) {
+    if (now < group->firstAboveTime) {
+      return false;
+    }
+    group->dropping = true;
+    group->dropCount = 1;
+    group->dropNext = now + CODEL_INTERVAL;
+    return true;
+  }
+  if (now < group->dropNext) {
+    return false;
+  }
+  // shed faster the longer the delay persists
+  group->dropCount++;
+  group->dropNext = now + (uint64_t) (CODEL_INTERVAL / sqrt((double) group->dropCount));
+  return true;
+}
+
+void *worker_main(void *arg) {
+  WorkerGroup *group = (WorkerGroup *) arg;
+  pin_to_cpu(group->cpu);
+
+  while (true) {
+    dthread_mutex_lock(&group->lock);
+    while (group->clients.empty()) {
+      dthread_cond_wait(&group->notEmpty, &group->lock);
+    }
+    QueuedClient queued = group->clients.front();
+    group->clients.pop_front();
+    bool shed = overloadPolicy == OVERLOAD_CODEL &&
+      codel_should_shed(group, Metrics::now(), queued.acceptedAt);
+    if (shed) {
+      group->shed++;
+    }
+    dthread_cond_signal(&group->notFull);
+    dthread_mutex_unlock(&group->lock);
+
+    if (shed) {
+      shed_client(queued.client);
+    } else {
+      handle_request(queued.client, queued.acceptedAt);
+    }
+  }
+
+  return NULL;
+}
+
+void *acceptor_main(void *arg) {
+  WorkerGroup *group = (WorkerGroup *) arg;
+  pin_to_cpu(group->cpu);
+
+  while(true) {
+    sync_print("waiting_to_accept", "");
+    MySocket *client;
+    try {
+      client = group->server->accept();
+    } catch (SocketError &e) {
+      // transient failures like running out of fds shouldn't kill the server
+      continue;
+    }
+    sync_print("client_accepted", "");
+    Metrics::connectionOpened();
+    QueuedClient queued = { client, Metrics::now() };
+
+    MySocket *victim = NULL;
+    dthread_mutex_lock(&group->lock);
+    if (group->clients.size() >= (size_t) BUFFER_SIZE) {
+      if (overloadPolicy == OVERLOAD_BLOCK) {
+        while (group->clients.size() >= (size_t) BUFFER_SIZE) {
+          dthread_cond_wait(&group->notFull, &group->lock);
+        }
+      } else if (overloadPolicy == OVERLOAD_DROP_OLDEST) {
+        victim = group->clients.front().client;
+        group->clients.pop_front();
+      } else {
+        victim = client;
+      }
+    }
+    if (victim != NULL) {
+      group->shed++;
+    }
+    if (victim != client) {
+      group->clients.push_back(queued);
+      dthread_cond_signal(&group->notEmpty);
+    }
+    dthread_mutex_unlock(&group->lock);
+
+    if (victim != NULL) {
+      shed_client(victim);
+    }
+  }
+
+  return NULL;
 }
 
 int main(int argc, char *argv[]) {
@@ -127,7 +406,7 @@ int main(int argc, char *argv[]) {
   signal(SIGPIPE, SIG_IGN);
   int option;
 
-  while ((option = getopt(argc, argv, "d:p:t:b:s:l:i:")) != -1) {
+  while ((option = getopt(argc, argv, "d:p:t:b:s:l:i:a:q:D:F:o:r:T:B:W:R:H:N:P:A:MK:c:")) != -1) {
     switch (option) {
     case 'd':
       BASEDIR = string(optarg);
@@ -148,31 +427,180 @@ int main(int argc, char *argv[]) {
       LOGFILE = string(optarg);
       break;
     case 'i':
-      DISKFILE = string(optarg);
+      // repeat -i to shard /ds3/ across several images
+      DISKFILES.push_back(string(optarg));
+      break;
+    case 'a':
+      ACCEPTORS = atoi(optarg);
+      break;
+    case 'q':
+      LISTEN_BACKLOG = atoi(optarg);
+      break;
+    case 'D':
+      DEFER_ACCEPT = atoi(optarg);
+      break;
+    case 'F':
+      FAST_OPEN = atoi(optarg);
+      break;
+    case 'o':
+      OVERLOAD = string(optarg);
+      break;
+    case 'r':
+      RETRY_AFTER = atoi(optarg);
+      break;
+    case 'T':
+      // idle and header timeouts
+      HTTPRequest::limits.idleTimeout = atoi(optarg) * 1000;
+      HTTPRequest::limits.headerTimeout = atoi(optarg) * 1000;
+      break;
+    case 'B':
+      HTTPRequest::limits.bodyTimeout = atoi(optarg) * 1000;
+      break;
+    case 'W':
+      HTTPRequest::limits.sendTimeout = atoi(optarg) * 1000;
+      break;
+    case 'R':
+      HTTPRequest::limits.minBodyRate = atol(optarg);
+      break;
+    case 'H':
+      HTTPRequest::limits.maxHeaderBytes = atol(optarg);
+      break;
+    case 'N':
+      HTTPRequest::limits.maxHeaders = atol(optarg);
+      break;
+    case 'P':
+      // repeat -P to replicate /ds3/ writes to several backups
+      BACKUPS.push_back(string(optarg));
+      break;
+    case 'A':
+      ACK_MODE = string(optarg);
+      break;
+    case 'M':
+      BACKUP_MODE = true;
+      break;
+    case 'K':
+      REPLICATION_TOKEN = string(optarg);
+      break;
+    case 'c':
+      // 0 turns the /ds3/ object cache off
+      CACHE_BYTES = atol(optarg);
       break;
     default:
-      cerr<< "usage: " << argv[0] << " [-p port] [-t threads] [-b buffers] [-i diskFile]" << endl;
+      cerr<< "usage: " << argv[0] << " [-p port] [-t threads] [-b buffers] [-i diskFile ...]"
+          << " [-a acceptors] [-q backlog] [-D deferAcceptSecs] [-F fastOpenQueue]"
+          << " [-o block|reject|drop-oldest|codel] [-r retryAfterSecs]"
+          << " [-T headerTimeoutSecs] [-B bodyTimeoutSecs] [-W sendTimeoutSecs] [-R minBodyBytesPerSec]"
+          << " [-H maxHeaderBytes] [-N maxHeaders]"
+          << " [-P backupHost:port ...] [-A sync|async] [-M] [-K replicationToken] [-c cacheBytes]" << endl;
       exit(1);
     }
   }
+  if (DISKFILES.empty()) {
+    DISKFILES.push_back("disk.img");
+  }
 
   set_log_file(LOGFILE);
 
   cout << "Lisening on port " << PORT << endl;
   
   sync_print("init", "");
-  MyServerSocket *server = new MyServerSocket(PORT);
-  MySocket *client;
 
-  // The order that you push services dictates the search order
-  // for path prefix matching
-  services.push_back(new DistributedFileSystemService(DISKFILE));
-  services.push_back(new FileService(BASEDIR));
-  
-  while(true) {
-    sync_print("waiting_to_accept", "");
-    client = server->accept();
-    sync_print("client_accepted", "");
-    handle_request(client);
+  if (ACCEPTORS < 1 || THREAD_POOL_SIZE < 1 || BUFFER_SIZE < 1) {
+    cerr << "acceptors, threads and buffers must all be at least 1" << endl;
+    exit(1);
+  }
+
+  if (OVERLOAD == "block") {
+    overloadPolicy = OVERLOAD_BLOCK;
+  } else if (OVERLOAD == "reject") {
+    overloadPolicy = OVERLOAD_REJECT;
+  } else if (OVERLOAD == "drop-oldest") {
+    overloadPolicy = OVERLOAD_DROP_OLDEST;
+  } else if (OVERLOAD == "codel") {
+    overloadPolicy = OVERLOAD_CODEL;
+  } else {
+    cerr << "unknown overload policy " << OVERLOAD << endl;
+    exit(1);
+  }
+
+  ServerSocketOptions options;
+  options.backlog = LISTEN_BACKLOG;
+  options.reusePort = ACCEPTORS > 1;
+  options.deferAcceptSeconds = DEFER_ACCEPT;
+  options.fastOpenQueue = FAST_OPEN;
+
+  if (BACKUP_MODE && !BACKUPS.empty()) {
+    cerr << "a backup (-M) can't have backups of its own (-P)" << endl;
+    exit(1);
+  }
+  if ((BACKUP_MODE || !BACKUPS.empty()) && REPLICATION_TOKEN.empty()) {
+    cerr << "a primary (-P) and its backups (-M) need the same token (-K)" << endl;
+    exit(1);
+  }
+  if (ACK_MODE != "sync" && ACK_MODE != "async") {
+    cerr << "unknown ack mode " << ACK_MODE << endl;
+    exit(1);
+  }
+
+  // requests go to the service with the longest matching path prefix,
+  // mount everything before the workers start
+  DistributedFileSystemService *fileSystem = new DistributedFileSystemService(DISKFILES, CACHE_BYTES);
+  vector<HttpService *> mounted = {
+    fileSystem,
+    new FileService(BASEDIR),
+    new MetricsService(),
+  };
+  // primaries and backups both keep a log of the writes they have, next
+  // to the first image
+  if (BACKUP_MODE || !BACKUPS.empty()) {
+    ReplicationLog *replicationLog = new ReplicationLog(DISKFILES[0] + ".replog");
+    if (BACKUP_MODE) {
+      fileSystem->setReadOnly(true);
+      mounted.push_back(new ReplicationService(fileSystem, replicationLog, REPLICATION_TOKEN));
+    } else {
+      fileSystem->replicateTo(new Replicator(replicationLog, BACKUPS, ACK_MODE == "sync", REPLICATION_TOKEN));
+    }
+  }
+  for (HttpService *service : mounted) {
+    router.mount(service);
+    Metrics::addRoute(service, service->pathPrefix());
+  }
+  Metrics::addCollector(render_queue_depth);
+  Metrics::addCollector(render_shed);
+
+  // -t is the total number of workers, split across the acceptors with
+  // the first THREAD_POOL_SIZE % ACCEPTORS groups taking one extra, and
+  // every group getting at least one
+  int workersPerGroup = THREAD_POOL_SIZE / ACCEPTORS;
+  int extraWorkers = THREAD_POOL_SIZE % ACCEPTORS;
+  long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int idx = 0; idx < ACCEPTORS; idx++) {
+    WorkerGroup *group = new WorkerGroup;
+    group->server = new MyServerSocket(PORT, options);
+    group->cpu = (ACCEPTORS > 1 && numCpus > 0) ? idx % numCpus : -1;
+    pthread_mutex_init(&group->lock, NULL);
+    pthread_cond_init(&group->notEmpty, NULL);
+    pthread_cond_init(&group->notFull, NULL);
+    group->firstAboveTime = 0;
+    group->dropNext = 0;
+    group->dropCount = 0;
+    group->dropping = false;
+    group->shed = 0;
+    groups.push_back(group);
+
+    int workers = max(1, workersPerGroup + (idx < extraWorkers ? 1 : 0));
+    for (int worker = 0; worker < workers; worker++) {
+      pthread_t thread;
+      dthread_create(&thread, NULL, worker_main, group);
+      dthread_detach(thread);
+    }
+  }
+
+  // the main thread accepts for the first group
+  for (int idx = 1; idx < ACCEPTORS; idx++) {
+    pthread_t thread;
+    dthread_create(&thread, NULL, acceptor_main, groups[idx]);
+    dthread_detach(thread);
   }
+  acceptor_main(groups[0]);
 }
@@ -1,14 +1,48 @@
 #ifndef _DISK_H_
 #define _DISK_H_
 
+#include <atomic>
 #include <string>
 #include <deque>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "ThreadCounters.h"
 
 struct UndoRecord {
   int blockNumber;
   unsigned char *blockData;
 };
 
+// The blocks that have been overwritten since a snapshot was taken, as
+// they were when it was taken. Each record in the file is the block
+// number followed by the block.
+struct DiskSnapshot {
+  std::string file;
+  int fd;
+  off_t fileSize;
+  // where each preserved block's record starts
+  std::unordered_map<int, off_t> preserved;
+
+  ~DiskSnapshot();
+};
+
+// running totals for the metrics endpoint
+enum DiskCounter {
+  DISK_BLOCK_READS,
+  DISK_BLOCK_WRITES,
+  DISK_COMMITS,
+  DISK_ROLLBACKS,
+  NUM_DISK_COUNTERS
+};
+typedef ThreadCounters<NUM_DISK_COUNTERS> DiskStats;
+
 class Disk {
  public:
   Disk(std::string imageFile, int blockSize);
@@ -19,13 +53,56 @@ class Disk {
   void beginTransaction();
   void commit();
   void rollback();
+
+  /**
+   * Snapshots are named, read-only views of the disk as it was when they
+   * were taken. Taking one is O(1): after that the first write to each
+   * block copies what it held into the snapshot's file, next to the
+   * image, before overwriting it. Take them between transactions.
+   */
+  // false if there's already one called name
+  bool createSnapshot(const std::string &name);
+  // false if there's none called name, reads already running on a deleted
+  // snapshot can see later writes
+  bool deleteSnapshot(const std::string &name);
+  std::vector<std::string> snapshots();
+  // a read-only Disk that reads the snapshot name, or NULL if there isn't
+  // one, for the caller to delete
+  Disk *openSnapshot(const std::string &name);
+
+  DiskStats &stats() { return diskStats; }
+  // goes up after every block write, so a caller that keeps what it read
+  // can tell whether it's still current
+  uint64_t writeVersion() { return writes.load(); }
   
  private:
+  Disk(Disk *origin, std::shared_ptr<DiskSnapshot> snapshot);
+  void sync();
+  void loadSnapshots();
+  // copies the block into every snapshot that doesn't have it yet
+  void preserveBlock(int blockNumber);
+  off_t preservedOffset(DiskSnapshot *snapshot, int blockNumber);
+  void readSnapshotBlock(DiskSnapshot *snapshot, int blockNumber, void *buffer);
+
+  DiskStats diskStats;
+  std::atomic<uint64_t> writes;
   std::string imageFile;
   int blockSize;
   int imageFileSize;
   bool isInTransaction;
   std::deque<struct UndoRecord> undoLog;
+  // blocks that already have an undo record in this transaction
+  std::unordered_set<int> undoneBlocks;
+  // written in this transaction and not flushed yet
+  bool needsSync;
+
+  std::map<std::string, std::shared_ptr<DiskSnapshot>> snapshotsByName;
+  // held across preserving and writing a block, and by snapshot reads
+  // only to look up what has been preserved
+  pthread_mutex_t snapshotLock;
+  // set on snapshot views, which read through origin
+  Disk *origin;
+  std::shared_ptr<DiskSnapshot> snapshot;
 };
 
 #endif
@@ -3,19 +3,183 @@
 
 #include "HttpService.h"
 #include "LocalFileSystem.h"
+#include "ObjectCache.h"
+#include "PathLockTable.h"
+#include "Replicator.h"
 
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
 #include <string>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
 
 class DistributedFileSystemService : public HttpService {
  public:
-  DistributedFileSystemService(std::string driveFile);
+  // Objects are spread over the driveFiles by the first component of their
+  // path, so a top level directory and everything under it live on one
+  // image. Only listings of the root span images. Up to cacheBytes of
+  // objects and listings are cached in memory.
+  DistributedFileSystemService(std::vector<std::string> driveFiles, size_t cacheBytes);
 
   virtual void get(HTTPRequest *request, HTTPResponse *response);
+  virtual void head(HTTPRequest *request, HTTPResponse *response);
   virtual void put(HTTPRequest *request, HTTPResponse *response);
   virtual void del(HTTPRequest *request, HTTPResponse *response);
+  // MOVE /ds3/<path> with a Destination header naming another /ds3/ path
+  // renames it without copying any data. "Overwrite: F" refuses to
+  // replace an existing destination.
+  virtual void move(HTTPRequest *request, HTTPResponse *response);
+  // COPY takes the same headers. Files copied within a shard share their
+  // data blocks until one of them is written, directories are copied
+  // file by file. A directory copied over an existing one replaces it,
+  // it isn't merged into it.
+  virtual void copy(HTTPRequest *request, HTTPResponse *response);
+
+  // GET on a directory with ?recursive=1 lists everything under it as
+  // paths relative to it, sorted, directories with a trailing /. It takes
+  //   depth=N         only go N levels down, 1 is the plain listing
+  //   prefix=P        only paths that start with P
+  //   start-after=K   only paths that sort after K
+  //   max-keys=M      at most M paths (and at most 1000), when there are
+  //                   more the X-Next-Start-After header has the last one
+  //
+  // ?snapshot=<name> reads any of these from a snapshot instead of the
+  // live file system. Snapshots are taken with POST /ds3/?snapshot=<name>,
+  // dropped with DELETE /ds3/?snapshot=<name> and listed by
+  // GET /ds3/?snapshots=1. They cover every shard at the same point in
+  // time, cost nothing to take, and belong to this server alone, they
+  // aren't replicated.
+  //
+  // With Accept: application/json a directory comes back as a JSON object
+  // with its name, type, size and inode number and the same for each of
+  // its entries. ?metadata=1 gives that object without the entries for
+  // files and directories alike.
+  struct ListQuery {
+    std::string snapshot;
+    std::string prefix;
+    std::string startAfter;
+    size_t maxKeys;
+    int depth;
+  };
+
+  // Batches, relative to the request's path:
+  //   POST ?batch=put  the body is "<pathLength> <bodyLength>\n<path><body>"
+  //                    per object, all written in one transaction per shard
+  //   POST ?batch=get  the body is one path per line, and the answer is
+  //                    "<pathLength> <status> <bodyLength>\n<path><body>"
+  //                    for each of them, or 413 if that comes to more
+  //                    than a request body may
+  //   DELETE ?recursive=1 deletes a directory and everything under it
+  virtual void post(HTTPRequest *request, HTTPResponse *response);
+
+  // Writes and deletes by path components, throwing ClientError on
+  // failure. When replicating they return the last LSN they logged,
+  // otherwise 0.
+  uint64_t putObject(const std::vector<std::string> &path, const std::string &data);
+  uint64_t deleteObject(const std::vector<std::string> &path, bool recursive = false);
+  uint64_t moveObject(const std::vector<std::string> &source, const std::vector<std::string> &destination,
+                      bool overwrite);
+  uint64_t copyObject(const std::vector<std::string> &source, const std::vector<std::string> &destination,
+                      bool overwrite);
+
+  // log committed writes for the backups
+  void replicateTo(Replicator *replicator);
+  // backups only take writes from their primary, clients get 403
+  void setReadOnly(bool readOnly);
 
 private:
-  LocalFileSystem *fileSystem;
+  // One disk image. LocalFileSystem and Disk keep no locks of their own.
+  // Requests lock the paths they touch in pathLocks, and anything that
+  // writes to the disk also holds writeLock, since every write shares the
+  // one Disk transaction and rewrites the shared bitmap and inode blocks.
+  struct Shard {
+    LocalFileSystem *fileSystem;
+    PathLockTable pathLocks;
+    pthread_mutex_t writeLock;
+    // the inode region as of inodesVersion of the disk's writeVersion, for
+    // recursive listings, under inodesLock
+    pthread_mutex_t inodesLock;
+    std::shared_ptr<const std::vector<inode_t>> inodes;
+    uint64_t inodesVersion;
+    // a file's ETag is its inode number and generation, which changes
+    // whenever the file is written, so it can be had without reading it
+    int numInodes;
+    std::unique_ptr<std::atomic<uint64_t>[]> generations;
+  };
+
+  // the path components after /ds3/, validated as directory entry names
+  std::vector<std::string> objectPath(HTTPRequest *request);
+  // the shard that holds the top level entry name
+  size_t shardIndex(const std::string &name);
+  Shard *shardFor(const std::string &name);
+  // walks components[0, count) from the root in one pass, returning the
+  // inode number or throwing notFound
+  int resolve(LocalFileSystem *fileSystem, const std::vector<std::string> &components, size_t count);
+  // how many leading components exist, stopping at the first one that's
+  // missing or isn't inside a directory
+  size_t existingDepth(LocalFileSystem *fileSystem, const std::vector<std::string> &components);
+  // adds the directory's entries
+  void listDirectory(LocalFileSystem *fileSystem, int inodeNumber, inode_t &inode,
+                     std::vector<ObjectCache::Child> &children);
+  // fills object in with the root listing of every shard merged together
+  void listRoot(ObjectCache::Entry &object, const std::string &snapshot);
+  void listRecursive(HTTPRequest *request, HTTPResponse *response, const std::vector<std::string> &path);
+  // the shard's inodes, cached until its disk is written to, or read
+  // from the snapshot's disk
+  std::shared_ptr<const std::vector<inode_t>> inodeTable(Shard *shard, LocalFileSystem *fileSystem,
+                                                         const std::string &snapshot);
+  // adds up to one more than query.maxKeys sorted keys from under path
+  void listSubtree(Shard *shard, const std::vector<std::string> &path, const ListQuery &query,
+                   std::vector<std::string> &keys);
+  // Locks prefix and everything under it for writing. The X lock goes on
+  // the deepest directory that exists, since that's the one that gains
+  // entries. Returns how many components of prefix exist.
+  size_t lockSubtree(Shard *shard, const std::vector<std::string> &prefix, PathLockGuard &held);
+  // creates or overwrites the file at path inside the caller's transaction
+  void writeObject(Shard *shard, const std::vector<std::string> &path, const std::string &data);
+  // copies the file or directory inodeNumber to name in parent, sharing
+  // the data blocks of every file
+  void copyEntry(Shard *shard, int inodeNumber, int parent, const std::string &name);
+  // gives the file a new generation, before its contents change
+  void touchFile(Shard *shard, int inodeNumber);
+  std::string fileEtag(Shard *shard, int inodeNumber);
+  // the source and destination paths of a MOVE or COPY, and whether it
+  // may replace the destination
+  void transferPaths(HTTPRequest *request, std::vector<std::string> &source, std::vector<std::string> &destination,
+                     bool &overwrite);
+  void putBatch(HTTPRequest *request, HTTPResponse *response, const std::vector<std::string> &prefix);
+  void getBatch(HTTPRequest *request, HTTPResponse *response, const std::vector<std::string> &prefix);
+  // answers a Range GET of a file that isn't cached by reading only the
+  // blocks the ranges cover, false if path is a directory or the ranges
+  // don't apply and the whole object should be sent
+  bool getRanges(HTTPRequest *request, HTTPResponse *response, const std::vector<std::string> &path);
+  // the object or listing at path, from the cache if it's there
+  std::shared_ptr<const ObjectCache::Entry> lookupObject(const std::vector<std::string> &path);
+  // the object or listing at path, from the file system or one of its
+  // snapshots
+  std::shared_ptr<const ObjectCache::Entry> readObject(const std::vector<std::string> &path,
+                                                       const std::string &snapshot = "");
+  void createSnapshot(const std::string &name);
+  void deleteSnapshot(const std::string &name);
+  std::string listSnapshots();
+  // drops the cached prefixes of path that are fromDepth or more long,
+  // and the listing one level above them
+  void invalidate(const std::vector<std::string> &path, size_t fromDepth);
+
+  std::vector<Shard *> shards;
+  Replicator *replicator;
+  bool readOnly;
+  ObjectCache cache;
+  // where file generations come from, starting somewhere new every run so
+  // an ETag from an earlier run never matches
+  std::atomic<uint64_t> nextGeneration;
+  // consistent hashing ring of (point, shard index), sorted by point, with
+  // several points per shard to even out the load
+  std::vector<std::pair<uint64_t, int>> ring;
 };
 
 #endif
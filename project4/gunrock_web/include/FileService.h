@@ -4,6 +4,7 @@
 #include "HttpService.h"
 
 #include <string>
+#include <vector>
 
 class FileService : public HttpService {
  public:
@@ -13,8 +14,11 @@ class FileService : public HttpService {
   virtual void head(HTTPRequest *request, HTTPResponse *response);
 
 private:
+  void serve(HTTPRequest *request, HTTPResponse *response, bool withBody);
   bool endswith(std::string str, std::string suffix);
   std::string readFile(std::string path);
+  void streamFile(std::string path, HTTPResponse *response);
+  bool readRanges(std::string path, std::vector<ByteRange> ranges, std::vector<std::string> &parts);
 
   std::string m_basedir;
 };
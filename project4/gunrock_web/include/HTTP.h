@@ -3,18 +3,42 @@
 
 #include "http_parser.h"
 
+#include <exception>
+#include <memory_resource>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
 
+#include <stdint.h>
+
+// Receives request body bytes as the parser produces them so large bodies
+// never need to be buffered in full, see HTTPRequest::readBody. Exceptions
+// thrown from onBodyData stop parsing and propagate out of HTTP::addData.
+class BodySink {
+ public:
+    virtual ~BodySink() {}
+    virtual void onBodyData(const char *data, size_t length) = 0;
+};
+
 class HTTP {
  public:
     typedef enum {INIT, HEADER, FIELD, VALUE, BODY, DONE} HttpState;
+    // why addData stopped short of the data it was given
+    typedef enum {PARSE_OK, PARSE_INVALID, PARSE_HEADERS_TOO_LARGE} ParseError;
 
-    HTTP(http_parser_type httpType = HTTP_REQUEST);
+    // all of the parser's strings and tables come from resource, normally
+    // the per-request arena
+    HTTP(http_parser_type httpType = HTTP_REQUEST,
+         std::pmr::memory_resource *resource = std::pmr::get_default_resource());
     ~HTTP();
 
     int addData(const unsigned char *data, int len);
+    ParseError getError() {return m_error;}
+    // caps on the request line plus headers and on the number of headers,
+    // 0 for no limit. Exceeding either stops parsing with
+    // PARSE_HEADERS_TOO_LARGE.
+    void setHeaderLimits(size_t maxBytes, size_t maxCount);
     bool isDone();
     bool isHeaderDone();
     std::string getProxyRequest(const char *userAgent = NULL);
@@ -22,6 +46,8 @@ class HTTP {
     std::string getHost();
     std::string getUrl();
     std::string getPath();
+    std::string_view getPathView() {return m_path;}
+    int getMethod() {return m_method;}
     bool isConnect() {return m_method == HTTP_CONNECT;}
     bool isHead() {return m_method == HTTP_HEAD;}
     bool isGet() {return m_method == HTTP_GET;}
@@ -29,11 +55,18 @@ class HTTP {
     bool isPost() {return m_method == HTTP_POST;}
     bool isDelete() {return m_method == HTTP_DELETE;}
     bool isMove() {return m_method == HTTP_MOVE;}
-    std::string getBody();
-    std::string getQuery() {return m_query;}
-    std::vector< std::pair< std::string *, std::string *> > getHeaders() {
-      return m_headers;
-    }
+    const std::string &getBody();
+    void setBodySink(BodySink *sink);
+    long getContentLength() {return m_contentLength;}
+    long getBodyBytesParsed() {return m_bodyBytesParsed;}
+    std::string getQuery() {return std::string(m_query);}
+
+    // Header access. Views point into this object's header buffer and stay
+    // valid for its lifetime. Lookups are case-insensitive.
+    bool findHeader(std::string_view field, std::string_view &value);
+    size_t numHeaders() {return m_headers.size();}
+    std::string_view headerField(size_t idx);
+    std::string_view headerValue(size_t idx);
   
  private:
     static int message_begin_cb(http_parser *parser);
@@ -53,8 +86,10 @@ class HTTP {
     void newHeaderField(const char *at, size_t len);
     void appendHeaderField(const char *at, size_t len);
     void appendHeaderValue(const char *at, size_t len);
-    void addHeaderField();
+    void indexHeaders();
+    static uint32_t hashHeaderField(std::string_view field);
     void messageComplete(unsigned char method);
+    bool headersTooLarge();
 
     http_parser_settings m_settings;
     http_parser m_parser;
@@ -62,18 +97,36 @@ class HTTP {
     bool m_doneParsing;
     bool m_headerDone;
 
-    std::string m_url;
-    std::string m_path;
-    std::string m_query;
-    std::string m_host;
-    std::string *m_field;
-    std::string *m_value;
-    std::vector< std::pair< std::string *, std::string *> > m_headers;
+    std::pmr::string m_url;
+    std::pmr::string m_path;
+    std::pmr::string m_query;
+    std::pmr::string m_host;
+
+    // Every field and value is appended to one buffer as the parser hands
+    // them to us, so each header is just a pair of offsets into it, no
+    // per-header allocations. Continuations from a later read are
+    // contiguous with the piece before them.
+    struct HeaderSpan {
+        uint32_t fieldOffset;
+        uint32_t fieldLength;
+        uint32_t valueOffset;
+        uint32_t valueLength;
+        uint32_t hash;
+    };
+    std::pmr::string m_headerBuffer;
+    std::pmr::vector<HeaderSpan> m_headers;
     std::string m_body;
+    BodySink *m_bodySink;
+    std::exception_ptr m_bodySinkError;
+    long m_contentLength;
+    long m_bodyBytesParsed;
     std::string m_statusStr;
     unsigned char m_method;
     http_parser_type m_httpType;
     int m_extraParsedBytes;
+    ParseError m_error;
+    size_t m_maxHeaderBytes;
+    size_t m_maxHeaders;
 };
 
 #endif
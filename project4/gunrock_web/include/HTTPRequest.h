@@ -4,30 +4,83 @@
 #include "MySocket.h"
 #include "http_parser.h"
 #include "HTTP.h"
+#include "HttpUtils.h"
+#include "ClientError.h"
 
 #include "WwwFormEncodedDict.h"
 #include "StringUtils.h"
 
 #include <map>
+#include <memory_resource>
 #include <string>
+#include <string_view>
 #include <vector>
 
+// Collects a request body in memory, throwing a 413 ClientError as soon as
+// it grows past maxSize. The buffer is sized up front from Content-Length.
+class BufferedBodySink : public BodySink {
+ public:
+  BufferedBodySink(size_t maxSize, long contentLength = -1);
+  virtual void onBodyData(const char *data, size_t length);
+  std::string &body() { return m_body; }
+
+ private:
+  size_t m_maxSize;
+  std::string m_body;
+};
+
+// Limits that keep slow or oversized requests from tying up a worker.
+// Timeouts are in milliseconds and 0 means wait forever.
+struct RequestLimits {
+  // for the first byte of the request to arrive
+  int idleTimeout = 15000;
+  // from the first byte until the headers are complete
+  int headerTimeout = 10000;
+  // longest a single read waits for more of the body
+  int bodyTimeout = 10000;
+  // longest a single write of the response waits for the client to read
+  int sendTimeout = 10000;
+  // bytes per second the body has to average once minRateGrace has
+  // passed since the service started reading it, 0 disables the check
+  long minBodyRate = 512;
+  int minRateGrace = 5000;
+  // request line plus headers, and the number of header lines
+  size_t maxHeaderBytes = 16 * 1024;
+  size_t maxHeaders = 100;
+};
+
 class HTTPRequest {
 public:
-  HTTPRequest(MySocket *sock, int serverPort);
+  // applies to every request, set it before any are read
+  static RequestLimits limits;
+
+  HTTPRequest(MySocket *sock, int serverPort,
+              std::pmr::memory_resource *resource = std::pmr::get_default_resource());
   ~HTTPRequest();
   
+  // reads the request line and headers, the body is read on demand
   bool readRequest();
+  // streams the rest of the body into sink as it comes off the socket
+  void readBody(BodySink *sink);
+  void discardBody();
+  long getContentLength() {return m_http->getContentLength();}
 
   std::string getHost();
   std::string getRequest();
   std::string getUrl();
   std::string getPath();
+  std::string_view getPathView() {return m_http->getPathView();}
   std::vector<std::string> getPathComponents();
-  std::string getHeader(std::string key);
+  // views into the path, allocated from the request's memory resource
+  std::pmr::vector<std::string_view> getPathViews();
+  // header values are views into the request, valid until it is deleted
+  std::string_view getHeader(std::string_view key);
+  bool hasHeader(std::string_view key);
+  bool getByteRanges(long size, std::vector<ByteRange> &ranges);
   bool hasAuthToken();
   std::string getAuthToken();
   bool isConnect();
+  int getMethod() {return m_http->getMethod();}
   bool isGet() {return m_http->isGet();}
   bool isHead() {return m_http->isHead();}
   bool isPut() {return m_http->isPut();}
@@ -36,18 +89,30 @@ public:
   bool isMove() {return m_http->isMove();}
   std::map<std::string, std::string> getParams();
   WwwFormEncodedDict formEncodedBody();
-  std::string getBody() {return m_http->getBody();}
+  const std::string &getBody();
   
   void printDebugInfo();
     
  protected:
     void onRead(const char *buffer, unsigned int len);
+    void readUntilDone();
+    // one recv into m_readBuffer, handed to the parser in place
+    void readOnce();
+    void growReadBuffer(size_t size);
 
     MySocket *m_sock;
+    std::pmr::memory_resource *m_resource;
     HTTP *m_http;
     int m_serverPort;
     unsigned long m_totalBytesRead;
     unsigned long m_totalBytesWritten;
+    char *m_readBuffer;
+    size_t m_readBufferSize;
+    // monotonic milliseconds, 0 until it happens
+    uint64_t m_firstByteAt;
+    uint64_t m_bodyStartedAt;
+    // a read failed, the connection can't be read any further
+    bool m_readFailed;
 };
 
 #endif
@@ -2,27 +2,68 @@
 #define HTTP_RESPONSE_H_
 
 #include <map>
+#include <memory_resource>
 #include <string>
+#include <vector>
+
+#include "HttpUtils.h"
+#include "MySocket.h"
 
 class HTTPResponse {
  public:
-  HTTPResponse();
+  HTTPResponse(MySocket *client = NULL,
+               std::pmr::memory_resource *resource = std::pmr::get_default_resource());
   void withStreaming();
+  void withoutBody();
   void setHeader(std::string name, std::string value);
   void setBody(std::string data);
+  // the Content-Length of a body that isn't set because it won't be sent,
+  // so a HEAD response doesn't have to read it
+  void setContentLength(long length);
+  // parts may be empty for a HEAD response, which only needs the headers
+  void setPartialBody(std::vector<ByteRange> ranges, std::vector<std::string> parts, long totalSize);
   void setContentType(std::string contentType);
   void setStatus(int status);
   int getStatus();
+  // the whole response as one string, send() avoids building this
   std::string response();
+  // writes the headers and body to the client with a single writev
+  void send();
+
+  /**
+   * Streaming responses.
+   *
+   * Services that produce their body incrementally call writeChunk as
+   * each piece is ready instead of setBody. The first call sends the
+   * status line and headers with chunked transfer encoding, so status and
+   * headers must be final by then. The framework calls endStream once the
+   * service returns. If the service fails after the headers went out the
+   * stream is marked broken and the connection is closed without the
+   * terminating chunk so the client can tell the body is incomplete.
+   */
+  void writeChunk(const void *buf, int numBytes);
+  void writeChunk(std::string data);
+  void endStream();
+  bool isStreaming();
+  bool isStreamBroken();
 
  private:
-  std::string statusToString();
+  const char *statusToString();
+  const std::pmr::string &formatHeaders();
+  void sendHeaders();
 
   int status;
   bool streaming;
-  std::map<std::string, std::string> headers;
+  bool omitBody;
+  bool headersSent;
+  bool streamBroken;
+  MySocket *client;
+  std::pmr::map<std::pmr::string, std::pmr::string, std::less<> > headers;
   std::string body;
+  // -1 when Content-Length is the size of body
+  long contentLength;
   std::string contentType;
+  std::pmr::string head;
 };
 
 #endif
@@ -3,6 +3,9 @@
 
 #include <string>
 #include <stdexcept>
+#include <vector>
+
+#include <time.h>
 
 #include "MySocket.h"
 #include "HTTPRequest.h"
@@ -19,6 +22,32 @@ class HttpService {
   virtual void post(HTTPRequest *request, HTTPResponse *response);
   virtual void del(HTTPRequest *request, HTTPResponse *response);
   virtual void move(HTTPRequest *request, HTTPResponse *response);
+  virtual void copy(HTTPRequest *request, HTTPResponse *response);
+
+ protected:
+  /**
+   * Conditional GET support.
+   *
+   * Sets the ETag (and Last-Modified, if lastModified >= 0) headers on
+   * the response and evaluates If-None-Match, falling back to
+   * If-Modified-Since when there is no If-None-Match header. Returns true
+   * and sets a 304 status if the client already has the current version,
+   * in which case the service should not produce a body.
+   */
+  bool notModified(HTTPRequest *request, HTTPResponse *response,
+                   std::string etag, time_t lastModified = -1);
+
+  /**
+   * Range support.
+   *
+   * Applies the request's Range header (and If-Range, against etag) to a
+   * representation of size bytes. Returns false when the whole body
+   * should be sent. Returns true with the ranges to send, which the
+   * service passes to HTTPResponse::setPartialBody. Unsatisfiable ranges
+   * throw a 416 ClientError.
+   */
+  bool rangeRequested(HTTPRequest *request, HTTPResponse *response, long size,
+                      std::string etag, std::vector<ByteRange> &ranges);
   
  private:
   std::string m_pathPrefix;
@@ -7,6 +7,8 @@
 #include <vector>
 #include <map>
 
+#include <time.h>
+
 #include "MySocket.h"
 
 class MalformedQueryString : public std::runtime_error {
@@ -14,12 +16,24 @@ class MalformedQueryString : public std::runtime_error {
 MalformedQueryString(std::string query) : std::runtime_error("could not parse query string " + query) {}
 };
 
+// an inclusive byte range from a Range header, already clamped to the
+// size of the representation
+struct ByteRange {
+  long first;
+  long last;
+};
+
 class HttpUtils {
  public:
   static std::map<std::string, std::string> params(std::string query);
   static void writeChunk(MySocket *client, const void *buf, int numBytes);
   static void writeLastChunk(MySocket *client);
 
+  // RFC 7231 IMF-fixdate formatting and parsing, parseHttpDate returns -1
+  // if the date can't be parsed
+  static std::string httpDate(time_t when);
+  static time_t parseHttpDate(std::string date);
+
   static std::vector<std::string> split(const std::string &s, char delim);
 
  private:
@@ -2,8 +2,10 @@
 #define _LOCAL_FILE_SYSTEM_H_
 
 #include <string>
+#include <vector>
 
 #include "Disk.h"
+#include "ThreadCounters.h"
 #include "ufs.h"
 
 /**
@@ -43,6 +45,22 @@
 #define EINVALIDTYPE       (9)
 // Unlinking '.' or '..'
 #define EUNLINKNOTALLOWED  (10)
+// Moving a directory into itself or one of its subdirectories
+#define EINVALIDMOVE       (11)
+
+// counts of the calls made through the public interface, for metrics
+enum FileSystemCounter {
+  FS_LOOKUPS,
+  FS_STATS,
+  FS_READS,
+  FS_WRITES,
+  FS_CREATES,
+  FS_UNLINKS,
+  FS_RENAMES,
+  FS_COPIES,
+  NUM_FS_COUNTERS
+};
+typedef ThreadCounters<NUM_FS_COUNTERS> FileSystemStats;
 
 class LocalFileSystem {
  public:
@@ -113,6 +131,19 @@ class LocalFileSystem {
    */
   int read(int inodeNumber, void *buffer, int size);
 
+  /**
+   * Read part of a file or directory.
+   *
+   * Like read, but starts `offset` bytes into the entity and only touches
+   * the data blocks that overlap [offset, offset + size). Reading past the
+   * end returns the bytes that exist, which may be zero.
+   *
+   * Success: number of bytes read
+   * Failure: -EINVALIDINODE, -EINVALIDSIZE.
+   * Failure modes: invalid inodeNumber, invalid size or offset.
+   */
+  int readAt(int inodeNumber, void *buffer, int size, int offset);
+
   /**
    * Remove a file or directory.
    *
@@ -126,6 +157,42 @@ class LocalFileSystem {
    * existing is NOT a failure by our definition. You can't unlink '.' or '..'
    */
   int unlink(int parentInodeNumber, std::string name);
+
+  /**
+   * Rename a file or directory.
+   *
+   * Moves the entry srcName in the directory srcParentInodeNumber to
+   * dstName in the directory dstParentInodeNumber. Only directory entries
+   * are rewritten, the inode and its data stay where they are. If dstName
+   * already exists it is replaced, as long as it's the same type and, for
+   * a directory, empty. Run it inside a Disk transaction to make it atomic.
+   *
+   * Success: 0
+   * Failure: -EINVALIDINODE, -ENOTFOUND, -EINVALIDNAME, -EINVALIDTYPE,
+   * -EDIRNOTEMPTY, -ENOTENOUGHSPACE, -EUNLINKNOTALLOWED, -EINVALIDMOVE
+   * Failure modes: either parent does not exist or isn't a directory,
+   * srcName does not exist, dstName is too long, dstName exists with a
+   * different type or is a directory that isn't empty, the new parent is
+   * full, either name is '.' or '..', or a directory would move into its
+   * own subtree.
+   */
+  int rename(int srcParentInodeNumber, std::string srcName, int dstParentInodeNumber, std::string dstName);
+
+  /**
+   * Copy a file without copying its data.
+   *
+   * Makes dstName in the directory dstParentInodeNumber a regular file
+   * that shares srcInodeNumber's data blocks, replacing the contents of
+   * an existing file with that name. A data block is in use for as long
+   * as any inode points at it, and write gives a file new blocks in
+   * place of ones it shares, so the two copies change independently.
+   *
+   * Success: 0
+   * Failure: -EINVALIDINODE, -EINVALIDNAME, -EINVALIDTYPE, -ENOTENOUGHSPACE.
+   * Failure modes: srcInodeNumber does not exist or isn't a regular file,
+   * or the create of dstName fails.
+   */
+  int copy(int srcInodeNumber, int dstParentInodeNumber, std::string dstName);
   
   /**
    * Some helper functions that you need to implement and use in your
@@ -143,10 +210,21 @@ class LocalFileSystem {
   void readInodeRegion(super_t *super, inode_t *inodes);
   void writeInodeRegion(super_t *super, inode_t *inodes);
 
+  // How many allocated inodes point at each data block, counting only the
+  // pointers each inode's size says it uses. Copies share blocks, and this
+  // is their reference count, since inode_t has no room for one.
+  void countBlockReferences(super_t *super, unsigned char *inodeBitmap, inode_t *inodes,
+                            std::vector<int> &references);
+
   // Normally we'd mark this as private but we expose it so that you can access
   // it in a function you add that is not part of the LocalFileSystem object but
   // can still access the disk.
   Disk *disk;
+
+  FileSystemStats &stats() { return fsStats; }
+
+ private:
+  FileSystemStats fsStats;
 };  
 
 #endif
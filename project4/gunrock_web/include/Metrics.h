@@ -0,0 +1,50 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <functional>
+#include <stdint.h>
+#include <string>
+
+// the phases of a request that get their own latency histogram
+enum RequestPhase {
+  PHASE_QUEUE,
+  PHASE_PARSE,
+  PHASE_SERVICE,
+  PHASE_WRITE,
+  NUM_PHASES
+};
+
+/**
+ * Request metrics in Prometheus text format.
+ *
+ * Every thread records into its own block of counters, and no other
+ * thread ever writes to that block, so recording costs a few plain
+ * stores with no locks or shared cache lines. Rendering sums the blocks
+ * of all threads.
+ *
+ * Routes and collectors are registered at startup, before any request
+ * is recorded.
+ */
+class Metrics {
+ public:
+  // registers a route label and returns its id for observe() and count*()
+  static int addRoute(const void *key, std::string name);
+  // the id for key, or the id of the catch-all "none" route
+  static int routeId(const void *key);
+
+  // adds text for metrics that live elsewhere, like the disk counters
+  static void addCollector(std::function<void(std::string &)> collector);
+
+  static void observe(int route, int method, RequestPhase phase, uint64_t nanos);
+  static void countResponse(int route, int method, int status,
+                            unsigned long bytesIn, unsigned long bytesOut);
+  static void connectionOpened();
+  static void connectionClosed();
+
+  // monotonic clock in nanoseconds
+  static uint64_t now();
+
+  static std::string render();
+};
+
+#endif
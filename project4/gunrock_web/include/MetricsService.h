@@ -0,0 +1,17 @@
+#ifndef _METRICSSERVICE_H_
+#define _METRICSSERVICE_H_
+
+#include "HttpService.h"
+
+#include <string>
+
+// serves the Metrics registry at /metrics
+class MetricsService : public HttpService {
+ public:
+  MetricsService();
+
+  virtual void get(HTTPRequest *request, HTTPResponse *response);
+  virtual void head(HTTPRequest *request, HTTPResponse *response);
+};
+
+#endif
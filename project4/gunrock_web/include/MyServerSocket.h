@@ -6,6 +6,23 @@
 
 #include "MySocket.h"
 
+/**
+ * tuning knobs for the listening socket, the defaults give you a plain
+ * single listener
+ */
+struct ServerSocketOptions {
+  // length of the kernel's queue of completed connections
+  int backlog = 10;
+  // lets several sockets bind the same port, the kernel spreads
+  // incoming connections across them
+  bool reusePort = false;
+  // when > 0, accept only wakes up once the client has sent data or
+  // this many seconds have passed
+  int deferAcceptSeconds = 0;
+  // when > 0, enables TCP Fast Open with this many pending requests
+  int fastOpenQueue = 0;
+};
+
 class MyServerSocket {
  public:
   /**
@@ -13,8 +30,9 @@ class MyServerSocket {
    * if it cannot bind, it will throw a socket exception.
    *
    * @param port the port to bind to
+   * @param options listen queue and socket options to apply before binding
    */
-  MyServerSocket(int port);
+  MyServerSocket(int port, const ServerSocketOptions &options = ServerSocketOptions());
   MyServerSocket() { serverFd = -1; }
   
   /**
@@ -0,0 +1,81 @@
+#ifndef OBJECT_CACHE_H_
+#define OBJECT_CACHE_H_
+
+#include <stdint.h>
+
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <pthread.h>
+
+/**
+ * LRU cache of whole /ds3/ objects and directory listings, keyed by
+ * path and bounded by the bytes of the bodies it holds.
+ *
+ * Writers invalidate what they change before they answer their client.
+ * Readers that miss note version() before going to the file system and
+ * pass it to insert, which drops the entry if anything was invalidated
+ * in between, so a fill that raced with a write never caches what the
+ * write replaced.
+ */
+class ObjectCache {
+ public:
+  // an entry in a cached directory
+  struct Child {
+    std::string name;
+    bool directory;
+    int size;
+    int inodeNumber;
+  };
+
+  struct Entry {
+    bool directory;
+    int inodeNumber;
+    // from the inode, so a directory's is the size of its entries
+    int size;
+    // the file contents, or the formatted listing
+    std::string body;
+    std::string etag;
+    // a directory's entries in listing order
+    std::vector<Child> children;
+
+    // what the entry counts for against the capacity
+    size_t bytes() const { return body.size() + children.size() * sizeof(Child); }
+  };
+
+  // entries larger than capacityBytes / MAX_ENTRY_FRACTION aren't cached,
+  // so a few big objects can't flush everything else
+  static const size_t MAX_ENTRY_FRACTION = 16;
+
+  // a capacity of 0 turns the cache off
+  ObjectCache(size_t capacityBytes);
+
+  // the entry for key, or NULL on a miss
+  std::shared_ptr<const Entry> lookup(const std::string &key);
+  uint64_t version();
+  void insert(const std::string &key, std::shared_ptr<const Entry> entry, uint64_t version);
+  void invalidate(const std::string &key);
+  // invalidates key and every key under it, for renames
+  void invalidateTree(const std::string &key);
+
+ private:
+  typedef std::list<std::pair<std::string, std::shared_ptr<const Entry>>> LruList;
+
+  void renderMetrics(std::string &out);
+
+  size_t m_capacity;
+  size_t m_bytes;
+  // most recently used first
+  LruList m_lru;
+  std::unordered_map<std::string, LruList::iterator> m_index;
+  uint64_t m_version;
+  uint64_t m_hits;
+  uint64_t m_misses;
+  uint64_t m_evictions;
+  pthread_mutex_t m_mutex;
+};
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef PATH_LOCK_TABLE_H_
+#define PATH_LOCK_TABLE_H_
+
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <pthread.h>
+
+/**
+ * Hierarchical reader/writer locks over file system paths. A request
+ * takes S (read) or X (write) on the path it works on and the matching
+ * intent mode, IS or IX, on every ancestor directory, so a writer on
+ * /a/b blocks readers of /a/b and everything below it but nothing in
+ * sibling subtrees.
+ *
+ * A request's whole lock set is granted at once under the table's mutex,
+ * which keeps callers from deadlocking on each other no matter what
+ * order their paths sort in.
+ *
+ * Requests that have to wait queue up on each of their paths, and a new
+ * request isn't granted a path ahead of an earlier waiter it conflicts
+ * with, so a steady stream of readers can't starve a writer. A release
+ * only wakes the requests waiting on the paths it released.
+ */
+class PathLockTable {
+ public:
+  enum Mode { IS, IX, S, X, NUM_MODES };
+
+  struct Lock {
+    std::string path;
+    Mode mode;
+  };
+
+  PathLockTable();
+
+  // Locks components[0, depth) in mode and every proper prefix of it in
+  // the intent mode for mode, adding them to locks. Paths are the
+  // components joined with "/", the root is "".
+  static void plan(const std::vector<std::string> &components, size_t depth, Mode mode,
+                   std::vector<Lock> &locks);
+
+  // blocks until every lock in locks can be granted
+  void acquire(const std::vector<Lock> &locks);
+  void release(const std::vector<Lock> &locks);
+
+ private:
+  struct Waiter {
+    const std::vector<Lock> *locks;
+    pthread_cond_t ready;
+  };
+
+  struct Entry {
+    int count[NUM_MODES];
+    // requests waiting for this path, oldest first
+    std::deque<Waiter *> waiting;
+  };
+
+  // whether locks conflict with neither the holders of their paths nor
+  // the requests queued on them ahead of self, which is NULL for a new
+  // request
+  bool grantable(const std::vector<Lock> &locks, Waiter *self);
+  void grant(const std::vector<Lock> &locks);
+  // wakes every request waiting on one of the paths in locks
+  void wake(const std::vector<Lock> &locks);
+
+  std::unordered_map<std::string, Entry> m_entries;
+  pthread_mutex_t m_mutex;
+};
+
+// Path locks held until it goes out of scope, so a ClientError thrown part
+// way through an operation still releases them.
+class PathLockGuard {
+ public:
+  PathLockGuard(PathLockTable *table) : m_table(table) {}
+  PathLockGuard(PathLockTable *table, const std::vector<PathLockTable::Lock> &locks) : m_table(table) {
+    acquire(locks);
+  }
+  ~PathLockGuard() { release(); }
+
+  void acquire(const std::vector<PathLockTable::Lock> &locks) {
+    m_table->acquire(locks);
+    m_held.insert(m_held.end(), locks.begin(), locks.end());
+  }
+  void release() {
+    if (!m_held.empty()) {
+      m_table->release(m_held);
+      m_held.clear();
+    }
+  }
+
+ private:
+  PathLockTable *m_table;
+  std::vector<PathLockTable::Lock> m_held;
+};
+
+#endif
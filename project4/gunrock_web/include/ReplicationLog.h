@@ -0,0 +1,89 @@
+#ifndef REPLICATION_LOG_H_
+#define REPLICATION_LOG_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+// the size a primary aims for when it batches records for a backup, a
+// batch goes over by at most one record
+static const size_t REPLICATION_BATCH_BYTES = 1024 * 1024;
+
+// how much of the log has to be droppable before truncate rewrites it
+static const size_t REPLICATION_COMPACT_BYTES = 16 * 1024 * 1024;
+
+// carries the secret a primary shares with its backups (-K), a backup
+// only takes records from whoever knows it
+static const char REPLICATION_TOKEN_HEADER[] = "X-Replication-Token";
+
+// One committed /ds3/ write. Log sequence numbers start at 1 and have no
+// gaps, on a primary and on every backup that has caught up with it.
+struct ReplicationRecord {
+  uint64_t lsn;
+  // HTTP_PUT, HTTP_DELETE, HTTP_MOVE or HTTP_COPY
+  int method;
+  // the path components after /ds3/ joined with "/"
+  std::string path;
+  // the object for a PUT, the destination path for a MOVE or COPY, empty
+  // for a DELETE
+  std::string body;
+};
+
+/**
+ * File of ReplicationRecords. A primary logs every write it commits and
+ * its backups append the same records as they apply them, so after a
+ * restart either side knows the last LSN it has.
+ *
+ * Each record is a text header "lsn method pathLength bodyLength\n"
+ * followed by the path and body bytes, and the same encoding is what
+ * the primary sends its backups. A torn record at the end of the file
+ * from a crash part way through an append is dropped when it's opened.
+ *
+ * Records every reader is done with are dropped from the front by
+ * truncate, so the file starts at some LSN after 1. The newest record is
+ * always kept so the file still says what the last LSN is.
+ */
+class ReplicationLog {
+ public:
+  ReplicationLog(std::string logFile);
+
+  uint64_t lastLsn();
+
+  // logs a write under the next LSN and returns that LSN
+  uint64_t append(int method, const std::string &path, const std::string &body);
+  // logs a record that already has an LSN, it must be lastLsn() + 1
+  void append(const ReplicationRecord &record);
+
+  // encoded records with LSNs after lsn, stopping at the first record
+  // that takes the batch past maxBytes but always including one. False
+  // if some of them have been truncated away.
+  bool readAfter(uint64_t lsn, size_t maxBytes, std::string &batch);
+
+  // drops the records up to lsn, but only once that frees at least
+  // REPLICATION_COMPACT_BYTES, since it rewrites what's left
+  void truncate(uint64_t lsn);
+
+  static void encode(const ReplicationRecord &record, std::string &out);
+  // decodes the record at offset in data and moves offset past it,
+  // returning false at the end of data or on a malformed record
+  static bool decode(const std::string &data, size_t &offset, ReplicationRecord &record);
+
+ private:
+  void write(const ReplicationRecord &record);
+
+  std::string m_file;
+  int m_fd;
+  // the LSN before the first record in the file
+  uint64_t m_base;
+  // m_offsets[lsn - m_base - 1] is where record lsn starts, m_end is the
+  // end of the last complete record
+  std::vector<off_t> m_offsets;
+  off_t m_end;
+  pthread_mutex_t m_mutex;
+};
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef _REPLICATIONSERVICE_H_
+#define _REPLICATIONSERVICE_H_
+
+#include "HttpService.h"
+#include "DistributedFileSystemService.h"
+#include "ReplicationLog.h"
+
+#include <pthread.h>
+
+// The backup's side of /ds3/ replication, mounted only on backups.
+//   GET /replication/lsn     the last LSN this backup has applied
+//   POST /replication/apply  applies a batch of records from the primary
+//                            and answers with the last LSN applied, or
+//                            409 and that LSN if the batch left a gap
+// Both answers are "<lsn> <skipped>", where skipped counts the records
+// this backup has skipped since it started because applying them failed
+// in a way retrying wouldn't fix, like a PUT it has no room for. Skipped
+// records are logged and still take up their LSN.
+// Both answer 403 unless the request carries the token the backup was
+// started with, so only its primary can write to a read-only backup.
+class ReplicationService : public HttpService {
+ public:
+  ReplicationService(DistributedFileSystemService *fileSystem, ReplicationLog *log,
+                     const std::string &token);
+
+  virtual void get(HTTPRequest *request, HTTPResponse *response);
+  virtual void post(HTTPRequest *request, HTTPResponse *response);
+
+ private:
+  void apply(const ReplicationRecord &record);
+  void authorize(HTTPRequest *request);
+  std::string answer(uint64_t lsn);
+  void renderMetrics(std::string &out);
+
+  DistributedFileSystemService *m_fileSystem;
+  ReplicationLog *m_log;
+  std::string m_token;
+  // batches are applied one at a time, in LSN order
+  pthread_mutex_t m_applyLock;
+  // under m_applyLock
+  uint64_t m_skipped;
+};
+
+#endif
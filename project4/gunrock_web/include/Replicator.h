@@ -0,0 +1,84 @@
+#ifndef REPLICATOR_H_
+#define REPLICATOR_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+#include "ReplicationLog.h"
+
+/**
+ * The primary's side of /ds3/ replication. Committed writes go into the
+ * ReplicationLog, and one sender thread per backup streams the log to
+ * that backup's ReplicationService in LSN order.
+ *
+ * A sender starts by asking its backup for the last LSN it applied and
+ * sends from there, so a backup that restarts, or a primary that does,
+ * picks up where the backup left off. A backup that can't be reached is
+ * retried every few seconds.
+ *
+ * In synchronous mode a write isn't acknowledged to the client until
+ * every backup that is up has applied it. Backups that are down don't
+ * hold writes up, they catch up once they are back. A backup that
+ * doesn't answer within a timeout counts as down.
+ *
+ * A record that fails to apply on a backup, say a PUT it has no room for,
+ * is skipped there rather than retried forever. The backup says how many
+ * it has skipped since it started, and we mark it diverged in the log and
+ * the metrics, since it no longer holds what we do. So is a backup that
+ * needs records we have already truncated from the log. The log is
+ * truncated up to the lowest LSN every backup has applied.
+ *
+ * Writes are logged after their transaction commits, so a primary that
+ * crashes in between keeps a write its backups never get.
+ */
+class Replicator {
+ public:
+  // backups are host:port, and token is the secret they share with us
+  Replicator(ReplicationLog *log, std::vector<std::string> backups, bool synchronous,
+             const std::string &token);
+
+  // logs a committed write for the backups and returns its LSN
+  uint64_t logged(int method, const std::string &path, const std::string &body);
+
+  // waits until the write at lsn is on the backups, if we're synchronous
+  void waitForBackups(uint64_t lsn);
+
+ private:
+  struct Backup {
+    Replicator *replicator;
+    std::string host;
+    int port;
+    pthread_t thread;
+    // the last LSN the backup told us it has, valid when known is set
+    uint64_t acked;
+    bool known;
+    bool up;
+    // records the backup skipped because they failed to apply there, or
+    // it needs ones we no longer have
+    uint64_t skipped;
+    bool diverged;
+  };
+
+  static void *sendLoop(void *arg);
+  // one request to the backup, true with the backup's LSN and how many
+  // records it has skipped if it answered
+  bool exchange(Backup *backup, std::string method, std::string path, std::string body,
+                uint64_t &lsn, uint64_t &skipped);
+  // the lowest LSN every backup has applied, with m_mutex held
+  uint64_t minimumAcked();
+  void renderMetrics(std::string &out);
+
+  ReplicationLog *m_log;
+  std::string m_token;
+  bool m_synchronous;
+  std::vector<Backup *> m_backups;
+  pthread_mutex_t m_mutex;
+  pthread_cond_t m_logged;
+  pthread_cond_t m_acked;
+};
+
+#endif
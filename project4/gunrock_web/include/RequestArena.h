@@ -0,0 +1,66 @@
+#ifndef _REQUEST_ARENA_H_
+#define _REQUEST_ARENA_H_
+
+#include <memory_resource>
+#include <new>
+#include <utility>
+#include <vector>
+
+/**
+ * A bump allocator for everything that lives for exactly one request.
+ *
+ * Allocations just advance a pointer through a list of blocks and
+ * deallocate does nothing. Once the response is written, reset() frees
+ * the whole request in one step and rewinds to the first block, keeping
+ * the blocks so the next request on the same thread doesn't need malloc
+ * at all. Each worker thread owns one arena, so there is no locking.
+ *
+ * It is a std::pmr::memory_resource so std::pmr containers and strings
+ * can allocate from it directly.
+ */
+class RequestArena : public std::pmr::memory_resource {
+ public:
+  RequestArena(size_t blockSize = 16 * 1024);
+  ~RequestArena();
+
+  void reset();
+  size_t bytesAllocated() { return m_bytesAllocated; }
+
+  // the arena for requests handled by the calling thread
+  static RequestArena *threadArena();
+
+ protected:
+  virtual void *do_allocate(size_t bytes, size_t alignment);
+  virtual void do_deallocate(void *p, size_t bytes, size_t alignment);
+  virtual bool do_is_equal(const std::pmr::memory_resource &other) const noexcept;
+
+ private:
+  struct Block {
+    char *data;
+    size_t size;
+  };
+
+  std::vector<Block> m_blocks;
+  size_t m_blockSize;
+  size_t m_current;
+  size_t m_offset;
+  size_t m_bytesAllocated;
+};
+
+// new/delete for objects placed in a memory resource, which may or may
+// not be an arena
+template <class T, class... Args>
+T *resourceNew(std::pmr::memory_resource *resource, Args&&... args) {
+  void *memory = resource->allocate(sizeof(T), alignof(T));
+  return new (memory) T(std::forward<Args>(args)...);
+}
+
+template <class T>
+void resourceDelete(std::pmr::memory_resource *resource, T *object) {
+  if (object != NULL) {
+    object->~T();
+    resource->deallocate(object, sizeof(T), alignof(T));
+  }
+}
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef SERVICE_ROUTER_H_
+#define SERVICE_ROUTER_H_
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "http_parser.h"
+#include "HttpService.h"
+
+/**
+ * Maps request paths to services with a radix trie over the services'
+ * path prefixes. Lookups find the longest mounted prefix of the path in
+ * one pass over it, and dispatch picks the service method from a table
+ * indexed by the parser's method number.
+ *
+ * All mounting happens at startup before any worker runs. After that the
+ * trie is never modified, so workers read it without locking.
+ */
+class ServiceRouter {
+ public:
+  typedef void (HttpService::*Handler)(HTTPRequest *request, HTTPResponse *response);
+
+  ServiceRouter();
+  ~ServiceRouter();
+
+  // mounts service at its pathPrefix(), replacing any previous service there
+  void mount(HttpService *service);
+
+  // the service with the longest prefix of path, or NULL
+  HttpService *route(std::string_view path);
+
+  // the service method for an http_method, or NULL if we don't support it
+  static Handler handler(int method);
+
+ private:
+  struct Node {
+    // the label on the edge leading into this node
+    std::string label;
+    HttpService *service;
+    // sorted by the first byte of their label, which is unique per child
+    std::vector<Node *> children;
+  };
+
+  Node *findChild(Node *node, char first);
+  void freeNode(Node *node);
+
+  Node *m_root;
+  static Handler s_handlers[HTTP_MERGE + 1];
+};
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef THREAD_COUNTERS_H_
+#define THREAD_COUNTERS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+// a small number for each thread, handed out the first time it counts
+inline int threadCounterSlot() {
+  static std::atomic<int> next(0);
+  thread_local int slot = next.fetch_add(1, std::memory_order_relaxed);
+  return slot;
+}
+
+/**
+ * N running totals that many threads add to without sharing cache
+ * lines, the way Metrics keeps its request counters. Each thread gets a
+ * block of its own that only it writes, so adding is a relaxed load and
+ * store rather than a locked read-modify-write. Threads past the
+ * MAX_THREAD_SLOTS'th share one overflow block and pay for the atomic
+ * add. sum() adds the blocks up when the totals are scraped.
+ */
+template <size_t N>
+class ThreadCounters {
+ public:
+  static const int MAX_THREAD_SLOTS = 256;
+
+  void add(size_t counter, uint64_t n = 1) {
+    int slot = threadCounterSlot();
+    if (slot < MAX_THREAD_SLOTS) {
+      std::atomic<uint64_t> &value = m_blocks[slot].values[counter];
+      value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    } else {
+      m_blocks[MAX_THREAD_SLOTS].values[counter].fetch_add(n, std::memory_order_relaxed);
+    }
+  }
+
+  uint64_t sum(size_t counter) const {
+    uint64_t total = 0;
+    for (int slot = 0; slot <= MAX_THREAD_SLOTS; slot++) {
+      total += m_blocks[slot].values[counter].load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+ private:
+  struct alignas(64) Block {
+    std::atomic<uint64_t> values[N];
+  };
+
+  // value-initialized, so every total starts at 0
+  Block m_blocks[MAX_THREAD_SLOTS + 1] = {};
+};
+
+#endif
@@ -9,13 +9,13 @@
 
 using namespace std;
 
-HttpClient::HttpClient(const char *inet_addr, int port, bool use_tls) {
+HttpClient::HttpClient(const char *inet_addr, int port, bool use_tls, int timeout) {
   if (use_tls) {
     //connection = new MySslSocket(inet_addr, port);
     cerr << "Removed SSL sockets for now" << endl;
     exit(1);
   } else {
-    connection = new MySocket(inet_addr, port);
+    connection = new MySocket(inet_addr, port, timeout);
   }
   
   stringstream host;
@@ -2,6 +2,9 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/time.h>
 #include <string.h>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -11,11 +14,15 @@
 
 using namespace std;
 
-MySocket::MySocket(const char *inetAddr, int port) {
-  call_connect(inetAddr, port);
+MySocket::MySocket(const char *inetAddr, int port, int timeout) {
+  m_bytesRead = 0;
+  m_bytesWritten = 0;
+  m_receiveTimeout = 0;
+  m_sendTimeout = 0;
+  call_connect(inetAddr, port, timeout);
 }
 
-void MySocket::call_connect(const char *inetAddr, int port) {
+void MySocket::call_connect(const char *inetAddr, int port, int timeout) {
     struct sockaddr_in server;
     struct addrinfo hints;
     struct addrinfo *res;
@@ -28,6 +35,7 @@ void MySocket::call_connect(const char *inetAddr, int port) {
     hints.ai_socktype = SOCK_STREAM;
     int ret = getaddrinfo(inetAddr, NULL, &hints, &res);
     if(ret != 0) {
+        ::close(sockFd);
         string str;
         str = string("Could not get host ") + string(inetAddr);
         throw SocketError(str.c_str());
@@ -37,20 +45,41 @@ void MySocket::call_connect(const char *inetAddr, int port) {
     server.sin_port = htons((short) port);
     server.sin_family = AF_INET;
     freeaddrinfo(res);
+
+    // SO_SNDTIMEO bounds connect() as well as the writes after it
+    if(timeout > 0) {
+        try {
+            setReceiveTimeout(timeout);
+            setSendTimeout(timeout);
+        } catch(SocketError &e) {
+            ::close(sockFd);
+            throw;
+        }
+    }
     
     // conenct to the server
     if( connect(sockFd, (struct sockaddr *) &server,
                 sizeof(server)) == -1 ) {
+        // the destructor never runs when the constructor throws
+        ::close(sockFd);
         throw SocketError("Did not connect to the server");
     }
 }
 
 MySocket::MySocket(void) {
     sockFd = -1;
+    m_bytesRead = 0;
+    m_bytesWritten = 0;
+    m_receiveTimeout = 0;
+    m_sendTimeout = 0;
 }
 
 MySocket::MySocket(int socketFileDesc) {
     sockFd = socketFileDesc;
+    m_bytesRead = 0;
+    m_bytesWritten = 0;
+    m_receiveTimeout = 0;
+    m_sendTimeout = 0;
 }
 
 MySocket::~MySocket(void) {
@@ -77,6 +106,42 @@ void MySocket::write_bytes(const void *buffer, int len) {
         }
         buf += bytesWritten;
         len -= bytesWritten;
+        m_bytesWritten += bytesWritten;
+    }
+}
+
+void MySocket::writev(const struct iovec *iov, int iovcnt) {
+    struct iovec remaining[IOV_MAX];
+
+    if (sockFd<0) {
+      throw SocketNotConnected();
+    }
+    if (iovcnt > IOV_MAX) {
+      // never happens for our callers, fall back to one write per buffer
+      for (int i = 0; i < iovcnt; i++) {
+        write_bytes(iov[i].iov_base, iov[i].iov_len);
+      }
+      return;
+    }
+
+    memcpy(remaining, iov, sizeof(struct iovec) * iovcnt);
+    struct iovec *next = remaining;
+    while(iovcnt > 0) {
+        ssize_t bytesWritten = ::writev(sockFd, next, iovcnt);
+        if(bytesWritten <= 0) {
+	  throw SocketWriteError();
+        }
+        m_bytesWritten += bytesWritten;
+        // skip the buffers that were fully written and trim a partial one
+        while (iovcnt > 0 && (size_t) bytesWritten >= next->iov_len) {
+          bytesWritten -= next->iov_len;
+          next++;
+          iovcnt--;
+        }
+        if (iovcnt > 0) {
+          next->iov_base = (char *) next->iov_base + bytesWritten;
+          next->iov_len -= bytesWritten;
+        }
     }
 }
 
@@ -91,10 +156,67 @@ string MySocket::read() {
     if(ret <= 0) {
       throw SocketReadError();
     }
+    m_bytesRead += ret;
   
     return string(buffer, ret);
 }
 
+int MySocket::recv(void *buffer, int len, int flags) {
+    if(sockFd<0) {
+      throw SocketNotConnected();
+    }
+
+    int ret;
+    do {
+      ret = ::recv(sockFd, buffer, len, flags);
+    } while(ret < 0 && errno == EINTR);
+
+    if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && !(flags & MSG_DONTWAIT)) {
+      throw SocketTimeout();
+    }
+    if(ret <= 0) {
+      throw SocketReadError();
+    }
+    m_bytesRead += ret;
+
+    return ret;
+}
+
+void MySocket::setReceiveTimeout(int milliseconds) {
+    if(sockFd<0) {
+      throw SocketNotConnected();
+    }
+    // callers set this before every read, skip the syscall when unchanged
+    if(milliseconds == m_receiveTimeout) {
+      return;
+    }
+
+    struct timeval tv;
+    tv.tv_sec = milliseconds / 1000;
+    tv.tv_usec = (milliseconds % 1000) * 1000;
+    if(setsockopt(sockFd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1) {
+      throw SocketError("could not set SO_RCVTIMEO");
+    }
+    m_receiveTimeout = milliseconds;
+}
+
+void MySocket::setSendTimeout(int milliseconds) {
+    if(sockFd<0) {
+      throw SocketNotConnected();
+    }
+    if(milliseconds == m_sendTimeout) {
+      return;
+    }
+
+    struct timeval tv;
+    tv.tv_sec = milliseconds / 1000;
+    tv.tv_usec = (milliseconds % 1000) * 1000;
+    if(setsockopt(sockFd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1) {
+      throw SocketError("could not set SO_SNDTIMEO");
+    }
+    m_sendTimeout = milliseconds;
+}
+
 void MySocket::close(void) {
     if(sockFd<0) return;
     
@@ -74,6 +74,15 @@ void MySslSocket::write(string buffer) {
   }
 }
 
+// TLS has no gather write, so coalesce the buffers into one record
+void MySslSocket::writev(const struct iovec *iov, int iovcnt) {
+  string buffer;
+  for (int i = 0; i < iovcnt; i++) {
+    buffer.append((const char *) iov[i].iov_base, iov[i].iov_len);
+  }
+  write(buffer);
+}
+
 string MySslSocket::read() {
   char buffer[4096];
   if(sockFd<0 || ssl == NULL) {
@@ -97,6 +106,27 @@ string MySslSocket::read() {
   return result;
 }
 
+// flags only make sense for the raw socket, TLS records are read whole
+int MySslSocket::recv(void *buffer, int len, int flags) {
+  if(sockFd<0 || ssl == NULL) {
+    throw SocketNotConnected();
+  }
+
+  int ret = SSL_read(ssl, buffer, len);
+
+  if(ret <= 0) {
+    throw SocketReadError();
+  }
+
+  if (debug_print_io) {
+    cout << "MySslSocket::recv" << endl;
+    cout << "-----------------" << endl;
+    cout << string((const char *) buffer, ret) << endl << endl;
+  }
+
+  return ret;
+}
+
 void MySslSocket::close() {
   if(NULL != ctx)
     SSL_CTX_free(ctx);
@@ -45,3 +45,22 @@ vector<string> StringUtils::split(string str, char delimiter) {
 
   return result;
 }
+
+pmr::vector<string_view> StringUtils::splitViews(string_view str, char delimiter,
+                                                 pmr::memory_resource *resource) {
+  pmr::vector<string_view> result(resource);
+
+  size_t start = 0;
+  while (start < str.size()) {
+    size_t end = str.find(delimiter, start);
+    if (end == string_view::npos) {
+      end = str.size();
+    }
+    if (end != start) {
+      result.push_back(str.substr(start, end - start));
+    }
+    start = end + 1;
+  }
+
+  return result;
+}
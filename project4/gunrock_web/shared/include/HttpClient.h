@@ -21,8 +21,10 @@ class HttpClient {
    *
    * @param inetAddr either ip address, or the domain name
    * @param port the port to connect to
+   * @param timeout milliseconds the connect, and each read and write of
+   *        the socket, may wait, 0 waits forever
    */
-  HttpClient(const char *inet_addr, int port, bool use_tls=false);
+  HttpClient(const char *inet_addr, int port, bool use_tls=false, int timeout=0);
   ~HttpClient();
 
 
@@ -4,6 +4,8 @@
 #include <stdexcept>
 #include <string>
 
+#include <sys/uio.h>
+
 class SocketNotConnected : public std::runtime_error {
  public:
   SocketNotConnected() : std::runtime_error("socket not connected") {}
@@ -19,6 +21,12 @@ class SocketReadError : public std::runtime_error {
   SocketReadError() : std::runtime_error("socket read error") {}
 };
 
+// a read that gave up after the socket's receive timeout
+class SocketTimeout : public SocketReadError {
+ public:
+  SocketTimeout() {}
+};
+
 class SocketError : public std::runtime_error {
  public:
   SocketError(std::string err) : std::runtime_error("socket error: " + err) {}
@@ -34,8 +42,10 @@ class MySocket {
    *
    * @param inetAddr either ip address, or the domain name
    * @param port the port to connect to
+   * @param timeout milliseconds the connect, and each read and write
+   *        after it, may wait, 0 waits forever
    */
-  MySocket(const char *inetAddr, int port);
+  MySocket(const char *inetAddr, int port, int timeout=0);
 
   /*
    * this constructor will generally not be used except for by ServerSockets
@@ -51,12 +61,40 @@ class MySocket {
 
   virtual std::string read();
   virtual void write(std::string data);
+  /*
+   * gathers all of the buffers into as few writes as possible, retrying
+   * until every byte has been written
+   */
+  virtual void writev(const struct iovec *iov, int iovcnt);
+  /*
+   * reads at most len bytes straight into the caller's buffer, returns
+   * the number of bytes read and throws SocketReadError on EOF or error
+   */
+  virtual int recv(void *buffer, int len, int flags=0);
+  /*
+   * bounds how long each recv() waits for data, 0 waits forever. recv()
+   * throws SocketTimeout when it expires.
+   */
+  void setReceiveTimeout(int milliseconds);
+  /*
+   * bounds how long each write waits for the peer to make room, 0 waits
+   * forever. The write calls throw SocketWriteError when it expires.
+   */
+  void setSendTimeout(int milliseconds);
   virtual void close(void);
+
+  // bytes that went through recv() and the write calls on this socket
+  unsigned long bytesRead() { return m_bytesRead; }
+  unsigned long bytesWritten() { return m_bytesWritten; }
   
  protected:
-  void call_connect(const char *inetAddr, int port);
+  void call_connect(const char *inetAddr, int port, int timeout);
   void write_bytes(const void *buffer, int len);
   int sockFd;
+  unsigned long m_bytesRead;
+  unsigned long m_bytesWritten;
+  int m_receiveTimeout;
+  int m_sendTimeout;
 };
 
 #endif
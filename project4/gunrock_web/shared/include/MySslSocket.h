@@ -21,6 +21,8 @@ class MySslSocket: public MySocket {
 
   std::string read();
   void write(std::string data);
+  void writev(const struct iovec *iov, int iovcnt);
+  int recv(void *buffer, int len, int flags=0);
   void close(void);
   
  protected:
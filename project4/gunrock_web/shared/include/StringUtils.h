@@ -1,13 +1,19 @@
 #ifndef _STRING_UTILS_H_
 #define _STRING_UTILS_H_
 
+#include <memory_resource>
 #include <string>
+#include <string_view>
 #include <vector>
 
 class StringUtils {
  public:
   static std::vector<std::string> splitWithDelimiter(std::string str, char delimiter);
   static std::vector<std::string> split(std::string str, char delimiter);
+  // split without copying, the views point into str and only the vector
+  // is allocated, from resource
+  static std::pmr::vector<std::string_view> splitViews(std::string_view str, char delimiter,
+                                                       std::pmr::memory_resource *resource);
   static std::string createAuthToken();
   static std::string createUserId();
 };
@@ -0,0 +1,18 @@
+#!/bin/bash
+set -e
+
+cp tests/disk_images/b.img tests-out/39.img
+
+# rename c.txt in place, then move /a/b under a new /x, which has to
+# point b's .. at x
+./ds3mv tests-out/39.img 2 c.txt 2 e.txt
+./ds3mkdir tests-out/39.img 0 x
+./ds3mv tests-out/39.img 1 b 4 b
+./ds3ls tests-out/39.img /a
+./ds3ls tests-out/39.img /x
+./ds3ls tests-out/39.img /x/b
+
+# x can't move into its own subdirectory, and the image stays as it was
+./ds3mv tests-out/39.img 0 x 2 x || echo "ds3mv returned $?"
+./ds3ls tests-out/39.img /
+./ds3bits tests-out/39.img
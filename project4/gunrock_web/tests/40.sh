@@ -0,0 +1,24 @@
+#!/bin/bash
+set -e
+
+cp tests/disk_images/b.img tests-out/40.img
+
+# the copy of d.txt gets a new inode but no new data blocks
+./ds3clone tests-out/40.img 5 2 e.txt
+./ds3ls tests-out/40.img /a/b
+./ds3bits tests-out/40.img
+
+# writing the copy gives it a block of its own and leaves d.txt alone
+./ds3cp tests-out/40.img tests/A.txt 4
+./ds3cat tests-out/40.img 4
+./ds3cat tests-out/40.img 5
+./ds3bits tests-out/40.img
+
+# unlinking d.txt while a copy still shares its blocks frees none of them,
+# unlinking the last copy frees them all
+./ds3clone tests-out/40.img 5 2 f.txt
+./ds3rm tests-out/40.img 2 d.txt
+./ds3bits tests-out/40.img
+./ds3rm tests-out/40.img 2 f.txt
+./ds3ls tests-out/40.img /a/b
+./ds3bits tests-out/40.img